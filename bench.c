@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+/* Benchmark harness for smallsh, built and run by make bench.
+ *
+ *   ./bench [path to smallsh] [scale]
+ *
+ * Each workload is written out as a script and run by smallsh with
+ * SMALLSH_TRACE set. Per command latency comes from the dispatch spans in
+ * the trace and launch latency from the spawn and fork spans. The last line
+ * of every script copies /proc/$$/status, which gives the shell's peak RSS
+ * (VmHWM) and how far its stack grew (VmStk). Each workload prints one JSON
+ * object per line on stdout so runs of two builds can be compared.
+ */
+
+struct workload {
+    const char *name;
+    int commands;
+    void (*write)(FILE *script, int commands);
+};
+
+struct spans {
+    double *values;
+    int count;
+    int capacity;
+};
+
+// Workloads
+void writeTrivial(FILE *script, int commands);
+void writeBuiltin(FILE *script, int commands);
+void writeDollar(FILE *script, int commands);
+void writeRedirect(FILE *script, int commands);
+void writeBackground(FILE *script, int commands);
+void writeLongArguments(FILE *script, int commands);
+
+// Running and measuring
+double nowSeconds();
+int runWorkload(const char *shell, struct workload *workload, int scale);
+void addSpan(struct spans *spans, double value);
+int readTrace(const char *path, struct spans *dispatch, struct spans *launch);
+long readStatusField(const char *path, const char *field);
+int compareDoubles(const void *a, const void *b);
+double percentile(struct spans *spans, double fraction);
+
+static char workDir[] = "/tmp/smallsh-bench-XXXXXX";
+
+int main(int argc, char *argv[]) {
+    struct workload workloads[] = {
+        {"trivial", 5000, writeTrivial},
+        {"builtin", 5000, writeBuiltin},
+        {"dollar", 2000, writeDollar},
+        {"redirect", 3000, writeRedirect},
+        {"background", 2000, writeBackground},
+        {"long-arguments", 200, writeLongArguments},
+    };
+    const char *shell = argc > 1 ? argv[1] : "./smallsh";
+    int scale = argc > 2 ? atoi(argv[2]) : 1;
+    int failed = 0;
+
+    if(scale < 1) scale = 1;
+    if(mkdtemp(workDir) == NULL) {
+        perror("mkdtemp()");
+        return 1;
+    }
+
+    for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if(runWorkload(shell, &workloads[i], scale) == -1) failed = 1;
+    }
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s", workDir);
+    if(system(command) != 0) fprintf(stderr, "bench: could not remove %s\n", workDir);
+    return failed;
+}
+
+// WORKLOADS
+/* Foreground commands that do nothing, so the time is all shell overhead
+ * and fork/exec. The workloads name /bin/true rather than true, which the
+ * shell runs itself without a child.
+ */
+void writeTrivial(FILE *script, int commands) {
+    for(int i = 0; i < commands; i++) fprintf(script, "/bin/true\n");
+}
+
+// The same commands run as a builtin, so no child is started at all.
+void writeBuiltin(FILE *script, int commands) {
+    for(int i = 0; i < commands; i++) fprintf(script, "true\n");
+}
+
+// Long lines where most words expand $$.
+void writeDollar(FILE *script, int commands) {
+    for(int i = 0; i < commands; i++) {
+        fprintf(script, "/bin/true");
+        for(int j = 0; j < 64; j++) fprintf(script, " $$ a$$b \"$$-%d\"", j);
+        fprintf(script, "\n");
+    }
+}
+
+// Every command opens a file for input, output or both.
+void writeRedirect(FILE *script, int commands) {
+    for(int i = 0; i < commands; i++) {
+        switch(i % 3) {
+        case 0: fprintf(script, "echo line %d > %s/out\n", i, workDir); break;
+        case 1: fprintf(script, "cat < %s/out > %s/copy\n", workDir, workDir); break;
+        default: fprintf(script, "wc -c < %s/copy\n", workDir); break;
+        }
+    }
+}
+
+// Bursts of background jobs, each burst waited for before the next.
+void writeBackground(FILE *script, int commands) {
+    for(int i = 0; i < commands; i++) {
+        fprintf(script, "/bin/true &\n");
+        if(i % 1000 == 999) fprintf(script, "wait\n");
+    }
+    fprintf(script, "wait\n");
+}
+
+// A few thousand arguments on every line.
+void writeLongArguments(FILE *script, int commands) {
+    for(int i = 0; i < commands; i++) {
+        fprintf(script, "/bin/true");
+        for(int j = 0; j < 4000; j++) fprintf(script, " argument-%d", j);
+        fprintf(script, "\n");
+    }
+}
+
+// RUNNING AND MEASURING
+double nowSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Writes the script for a workload, runs it and prints its summary.
+ * Returns -1 if the shell could not be run.
+ */
+int runWorkload(const char *shell, struct workload *workload, int scale) {
+    char scriptPath[256], tracePath[256], statusPath[256];
+    struct spans dispatch = {NULL, 0, 0}, launch = {NULL, 0, 0};
+    int commands = workload->commands * scale;
+    int childStatus;
+
+    snprintf(scriptPath, sizeof(scriptPath), "%s/%s.sh", workDir, workload->name);
+    snprintf(tracePath, sizeof(tracePath), "%s/%s.json", workDir, workload->name);
+    snprintf(statusPath, sizeof(statusPath), "%s/%s.status", workDir, workload->name);
+
+    FILE *script = fopen(scriptPath, "w");
+    if(script == NULL) {
+        perror(scriptPath);
+        return -1;
+    }
+    workload->write(script, commands);
+    fprintf(script, "cat /proc/$$/status > %s\n", statusPath);
+    fclose(script);
+
+    double started = nowSeconds();
+    pid_t pid = fork();
+    if(pid == 0) {
+        int quiet = open("/dev/null", O_WRONLY);
+        dup2(quiet, STDOUT_FILENO);
+        setenv("SMALLSH_TRACE", tracePath, 1);
+        // Compiled scripts go with the rest of the run's files.
+        char cachePath[256];
+        snprintf(cachePath, sizeof(cachePath), "%s/cache", workDir);
+        setenv("SMALLSH_CACHE", cachePath, 1);
+        execl(shell, shell, scriptPath, (char *)NULL);
+        perror(shell);
+        _exit(127);
+    }
+    if(pid == -1 || waitpid(pid, &childStatus, 0) == -1) {
+        perror("bench");
+        return -1;
+    }
+    double seconds = nowSeconds() - started;
+    if(!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) == 127) {
+        fprintf(stderr, "bench: %s failed running %s\n", shell, workload->name);
+        return -1;
+    }
+
+    if(readTrace(tracePath, &dispatch, &launch) == -1) {
+        fprintf(stderr, "bench: no trace from %s, does it support SMALLSH_TRACE?\n", shell);
+        return -1;
+    }
+
+    printf("{\"workload\":\"%s\",\"commands\":%d,\"seconds\":%.3f,\"commands_per_second\":%.0f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"launches\":%d,\"launch_p50_us\":%.1f,\"launch_p99_us\":%.1f,"
+           "\"peak_rss_kb\":%ld,\"stack_kb\":%ld}\n",
+           workload->name, dispatch.count, seconds, dispatch.count / seconds,
+           percentile(&dispatch, 0.50), percentile(&dispatch, 0.99),
+           launch.count, percentile(&launch, 0.50), percentile(&launch, 0.99),
+           readStatusField(statusPath, "VmHWM:"), readStatusField(statusPath, "VmStk:"));
+    fflush(stdout);
+
+    free(dispatch.values);
+    free(launch.values);
+    return 0;
+}
+
+void addSpan(struct spans *spans, double value) {
+    if(spans->count == spans->capacity) {
+        spans->capacity = spans->capacity == 0 ? 1024 : spans->capacity * 2;
+        spans->values = realloc(spans->values, spans->capacity * sizeof(double));
+    }
+    spans->values[spans->count++] = value;
+}
+
+/* The shell writes one trace event per line, so each line is checked for
+ * its name and duration in microseconds.
+ */
+int readTrace(const char *path, struct spans *dispatch, struct spans *launch) {
+    FILE *trace = fopen(path, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+
+    if(trace == NULL) return -1;
+    while(getline(&line, &capacity, trace) != -1) {
+        char *duration = strstr(line, "\"dur\":");
+        if(duration == NULL) continue;
+
+        double value = strtod(duration + 6, NULL);
+        if(strstr(line, "\"name\":\"dispatch\"") != NULL) addSpan(dispatch, value);
+        else if(strstr(line, "\"name\":\"spawn\"") != NULL || strstr(line, "\"name\":\"fork\"") != NULL) addSpan(launch, value);
+    }
+    free(line);
+    fclose(trace);
+    return 0;
+}
+
+// Returns the number after field in a /proc status file, or -1.
+long readStatusField(const char *path, const char *field) {
+    FILE *status = fopen(path, "r");
+    char line[256];
+    long value = -1;
+
+    if(status == NULL) return -1;
+    while(fgets(line, sizeof(line), status) != NULL) {
+        if(strncmp(line, field, strlen(field)) == 0) {
+            value = atol(line + strlen(field));
+            break;
+        }
+    }
+    fclose(status);
+    return value;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double left = *(const double *)a, right = *(const double *)b;
+    return (left > right) - (left < right);
+}
+
+// Nearest rank percentile, sorting the values in place.
+double percentile(struct spans *spans, double fraction) {
+    if(spans->count == 0) return 0;
+    qsort(spans->values, spans->count, sizeof(double), compareDoubles);
+
+    int rank = (int)(fraction * spans->count + 0.5);
+    if(rank < 1) rank = 1;
+    if(rank > spans->count) rank = spans->count;
+    return spans->values[rank - 1];
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -7,862 +8,5822 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
+#include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+
+extern char **environ;
 
 
 // Initiate the shell
-void startShell();
+struct inputSource;
+void initShell();
+int startShell(struct inputSource *source);
 
 // Sanitize and gather user input
 int verifyUserInput(char *userInput);
-char* getUserInput();
+char* getUserInput(struct inputSource *source);
+int mapFile(struct inputSource *source, int fd);
+int openScript(struct inputSource *source, const char *path);
+void openStandardInput(struct inputSource *source);
+void openCommandString(struct inputSource *source, const char *commands);
+char *nextMappedLine(struct inputSource *source);
 struct command;
-struct command *createCommand(char userCommand[]);
 struct command *createCommandList(char userInput[]);
+struct command *newCommand(int connector);
 struct status;
 
-// Free and clean up user inputs
-void cleanMemoryAndReturnToShell();
-void freeList(struct command *list);
+// History
+int openHistory();
+void addHistory(const char *line);
+int getHistory(uint64_t number, char *out);
+uint64_t firstHistory();
+uint64_t lastHistory();
+uint64_t searchHistory(const char *text, uint64_t before, int prefixOnly, char *out);
+char *expandHistory(char *line);
+struct stage;
+void historyCommand(struct stage *stage);
+
+// Line editor and completion
+char *editLine();
+void refreshLine();
+void insertText(const char *text, size_t length);
+void deleteText(size_t from, size_t to);
+void recallHistory(int direction);
+int reverseSearch();
+void completeWord();
+struct matchList;
+void addMatch(struct matchList *matches, const char *text);
+void listMatches(struct matchList *matches, size_t skip);
+int compareMatches(const void *a, const void *b);
+void completePath(const char *word, struct matchList *matches);
+void updateCommandTrie();
+int trieChild(int node, char letter, int create);
+void trieAdjust(const char *name, int delta);
+void trieCollect(int node, char *name, size_t length, struct matchList *matches);
+struct pathDirectory;
+void scanDirectory(struct pathDirectory *directory);
+void forgetDirectory(struct pathDirectory *directory);
+
+// Per line memory and parsing
+struct arena;
+void *arenaAlloc(struct arena *arena, size_t size);
+void arenaReset(struct arena *arena);
+struct stage;
+void addArgument(struct stage *stage, char *word);
+struct stage *addStage(struct command *cmd);
+struct lexer;
+void startLexer(struct lexer *lexer, const char *input);
+void reserveOutput(struct lexer *lexer, size_t needed);
+int isWordEnd(char c);
+const char *expandDollar(struct lexer *lexer, const char *p, const char **next);
+void appendExpansion(struct lexer *lexer, const char *value, int quoted);
+char *lexWord(struct lexer *lexer);
+int expandCommand(struct command *cmd);
+int expandWord(char *word, struct stage *stage, char **redirect);
+const char *findClosingParen(const char *p);
+char *captureOutput(char *text);
+int isShellCommand(const char *name);
+
+// Shell variables
+unsigned int hashBytes(const char *bytes, size_t length);
+struct variable;
+struct variable *findVariable(const char *name, size_t length);
+const char *getVariable(const char *name, size_t length);
+void setVariable(const char *name, size_t length, const char *value, int exported);
+void unsetVariable(const char *name, size_t length);
+void importEnvironment();
+void syncEnvironment();
+size_t nameLength(const char *text);
+size_t isAssignment(const char *word);
+void runWithAssignments(struct command *cmd, int assignments);
+void exportCommand(struct stage *stage);
+void unsetCommand(struct stage *stage);
+
+// Compiled scripts
+struct cacheWriter;
+struct cachedLine;
+void useScriptCache(struct inputSource *source, const char *path);
+int loadScriptCache(struct inputSource *source, const char *cachePath, const char *scriptPath, struct stat *info);
+int compileScript(struct inputSource *source, const char *cachePath, const char *scriptPath, struct stat *info);
+void compileLine(struct cacheWriter *writer, char *line);
+void appendCache(struct cacheWriter *writer, const void *data, size_t length);
+void flushCache(struct cacheWriter *writer);
+uint32_t cacheReference(const char *word, uint32_t *offset);
+int checkCachedLine(struct cachedLine *record, size_t room);
+struct command *nextCachedLine(struct inputSource *source);
 
 // Functions for program
-void activateCommands(struct command *list);
-void changeDirectory(struct command *list);
-int verifyBackgroundProcessRequest(struct command *list);
-int verifyIfChildRedirect(struct command *list);
-void redirectProcess(struct command *list, int type);
-char* expandVariablesToPid(char variable[]);
-void runProcess(struct command *list, int type);
-int getLengthOfPID(pid_t pid);
+void runLine(struct command *cmd);
+void runCommandList(struct command *cmd);
+void startBackgroundList(struct command *cmd);
+void activateCommands(struct command *cmd);
+void changeDirectory(struct stage *stage);
+void redirectProcess(struct command *cmd, int type);
+int copyInProcess(struct stage *stage);
+int copyFile(int inputFD, int outputFD);
+void runProcess(struct command *cmd, int type);
+void timeCommand(struct command *cmd);
 void toggleForegroundMode();
-void handleSignals(int signo);
-void addPidToBackgroundList(pid_t pid);
 
-// Status
+// Builtins that run inside the shell
+struct builtin;
+struct builtin *findBuiltin(const char *name);
+void addBuiltinNames();
+void runBuiltin(struct stage *stage, struct builtin *builtin);
+const char *printEscape(const char *escape, int echoStyle, int *stop);
+int echoCommand(int argc, char **argv);
+int trueCommand(int argc, char **argv);
+int falseCommand(int argc, char **argv);
+int pwdCommand(int argc, char **argv);
+int printfCommand(int argc, char **argv);
+int printFormat(const char *format, char ***args, int *remaining, int *stop);
+struct testParser;
+int testCommand(int argc, char **argv);
+int testOr(struct testParser *parser);
+int testAnd(struct testParser *parser);
+int testNot(struct testParser *parser);
+int testPrimary(struct testParser *parser);
+int testFile(const char *op, const char *path);
+int killCommand(int argc, char **argv);
+int signalNumber(const char *name);
+
+// Launching child processes
+long long nowNs();
+void initSettings();
+void recordLaunchLatency(int mode, long long elapsed);
+int openRedirects(const char *input, const char *output, int *inputFD, int *outputFD);
+struct launchRequest;
+pid_t spawnChild(const char *path, struct launchRequest *request);
+pid_t forkChild(const char *path, struct launchRequest *request);
+pid_t startChild(struct launchRequest *request);
+pid_t launchProcess(char *argv[], const char *input, const char *output, int type);
+void launchCommand(struct stage *stage);
+void waitForeground(pid_t pid);
+int waitChild(pid_t pid, int *childStatus);
+struct jobUsage;
+void startUsage(struct jobUsage *usage);
+void addUsage(struct jobUsage *usage, const struct rusage *part);
+void recordUsage(struct jobUsage *usage, char *commandLine);
+void printUsage(FILE *out, struct jobUsage *usage);
+
+// Resource limits
+struct jobLimits;
+int findLimit(const char *name, char option);
+int parseLimit(const char *text, rlim_t unit, rlim_t *value);
+void printLimit(rlim_t value, rlim_t unit);
+int applyLimits(const struct jobLimits *limits);
+const char *limitReason(int childStatus, const struct jobLimits *limits, const struct rusage *usage);
+void limitCommand(struct command *cmd);
+void ulimitCommand(struct stage *stage);
+
+// Placing background jobs on cpus
+struct placement;
+int parsePlacement(char *word, struct placement *placement);
+struct placement *choosePlacement(struct launchRequest *request);
+int nextSpreadCpu();
+void describePlacement(const struct placement *placement, char *text, size_t size);
+int applyPlacement(const struct placement *placement);
+void schedCommand(struct command *cmd);
+
+// Pipelines
+void runPipeline(struct command *cmd, int type);
+void dispatchJob(struct command *cmd, int type);
+
+// Parallel
+struct parallelInput;
+char *nextParallelInput(struct parallelInput *inputs);
+void fillParallelArgv(char **words, int count, const char *input, char **argv, char **buffer, size_t *capacity);
+void flushOutput(int outputFD, int destination);
+void parallelCommand(struct stage *stage);
+
+// Serving commands over a socket
+struct client;
+int serveCommands(const char *path);
+int openServerSocket(const char *path);
+void acceptClients();
+void readClient(int index);
+void serveLine(int index, char *line);
+int hasSubstitution(struct command *cmd);
+void replyStatus(struct client *client, int sequence, int outputFD, int exitStatus);
+void releaseClient(int index);
+void serverJobDone(int slot);
+
+// Tracing
+void openTrace();
+long long traceStart();
+void addSpan(const char *name, long long startNs, pid_t child, int childTrack);
+void traceEnd(const char *name, long long startNs, pid_t child);
+void traceJob(long long startNs, pid_t child);
+void flushTrace();
+void forgetTrace();
+void closeTrace();
+
+// Executable lookup cache
+unsigned int hashString(const char *string);
+const char *resolveCommand(const char *name);
+char *searchPath(const char *name, const char *pathValue);
+void insertCommandPath(const char *name, char *path);
+void forgetCommand(const char *name);
+void clearCommandCache();
+void hashCommand(struct stage *stage);
+
+// Status and background jobs
 void getStatus();
-void checkPid();
+void watchChildren();
+int checkPid();
+int waitForInput();
+unsigned int hashPid(pid_t pid);
+int findJobSlot(pid_t pid);
+void mapPid(pid_t pid, int jobSlot);
+void unmapPid(pid_t pid);
+char *describeCommand(struct command *cmd);
+int addJob(struct command *cmd, pid_t *pids, int count);
+void finishJob(int slot);
+int reapChild(pid_t pid, int childStatus, const struct rusage *usage);
+void startBackgroundJob(struct command *cmd, pid_t *pids, int count);
+void listJobs();
+void waitCommand(struct stage *stage);
+int findJob(const char *target);
+void signalJob(int slot, int signal);
+
+// Background queue
+struct queuedJob;
+int queueIsFull();
+struct command *copyCommand(struct command *cmd);
+void queueJob(struct command *cmd);
+void startQueuedJobs();
+void queueCommand(struct stage *stage);
+
+// Where input lines come from, see INPUT SOURCES below.
+enum inputKind { INPUT_TERMINAL, INPUT_STREAM, INPUT_MAPPED, INPUT_STRING, INPUT_CACHED };
+
+struct inputSource {
+    int kind;
+    int edit;
+    char *map;
+    size_t length;
+    size_t position;
+    char *line;
+    size_t capacity;
+};
 
 // MAIN PROGRAM
-int main() {
-    startShell();
-    return 0;
+/* smallsh              -> read commands from standard input
+ * smallsh script       -> run the commands in a script file
+ * smallsh -c 'command' -> run the given command line(s)
+ * smallsh --serve sock -> run command lines sent to a UNIX socket
+ */
+int main(int argc, char *argv[]) {
+    struct inputSource source;
+
+    if(argc >= 2 && strcmp(argv[1], "--serve") == 0) {
+        if(argc < 3) {
+            fprintf(stderr, "usage: smallsh --serve socket\n");
+            return 2;
+        }
+        return serveCommands(argv[2]);
+    } else if(argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        if(argc < 3) {
+            fprintf(stderr, "usage: smallsh [script | -c command | --serve socket]\n");
+            return 2;
+        }
+        openCommandString(&source, argv[2]);
+    } else if(argc >= 2) {
+        if(openScript(&source, argv[1]) == -1) return 1;
+        useScriptCache(&source, argv[1]);
+    } else {
+        openStandardInput(&source);
+    }
+    return startShell(&source);
+};
+
+// Launch backends, see LAUNCH ENGINE below.
+enum launchMode { LAUNCH_SPAWN = 0, LAUNCH_FORK = 1 };
+
+// Running latency numbers for one launch backend.
+struct launchStats {
+    long count;
+    long long totalNs;
+    long long minNs;
+    long long maxNs;
+};
+
+/* Everything the launch engine needs to start one child. inputFD and
+ * outputFD are -1 to inherit the shell's. processGroup is -1 to stay in
+ * the shell's group, 0 to lead a new group, or the group to join.
+ */
+struct launchRequest {
+    char **argv;
+    int inputFD;
+    int outputFD;
+    int type;
+    pid_t processGroup;
+    struct placement *placement;    // set by startChild()
+};
+
+/* Resource limits given to one command with the limit prefix. set has a
+ * bit for each entry of limitNames[] that has a value.
+ */
+struct jobLimits {
+    int set;
+    rlim_t values[8];
+};
+
+/* What a job cost, summed over all of its processes. The wall time runs
+ * from the launch until the last process is reaped.
+ */
+struct jobUsage {
+    long long startNs;
+    long long wallNs;
+    int processes;
+    struct rusage rusage;
 };
 
 // STATUS TRACKING
 // Keep track of exit status of the last foreground
-// process, background pid's and their exit status, and toggles foregroundOnlyMode
-// backgrounds are limited to 200 which is the number of processes os1 is allowed.
+// process and toggles foregroundOnlyMode. Background
+// jobs are tracked in the JOB TABLE further down.
 struct status{
     int lastStatus;
     int foregroundOnlyMode;
-    pid_t backgrounds[200];
+    int launchMode;
+    struct launchStats launchStats[2];
+    int pipeSize;
+    int fastCopy;
+    int interactive;
+    pid_t shellGroup;
+    char pidString[16];
+    int pidLength;
+    pid_t lastBackground;
+    struct jobLimits *limits;       // limits for the command being started
+    struct placement *placement;    // sched prefix of the command being started
+    char placementText[64];         // where the last child was placed
+    int spreadCpu;
+    int maxJobs;                    // background jobs allowed to run at once, 0 for any number
+    const char *lastLimit;          // the limit that ended the last job, if one did
+    int backgroundList;             // set in the fork running a background list
+    int forked;                     // set in a fork running a list or a $( ), which ends with _exit
+    int childEvents;
+    struct jobUsage commandUsage;   // foreground children of the current line
+    struct jobUsage lastUsage;
+    char *lastCommand;
+    long usageCount;
 };
 
 static struct status currStatus = {0, 0};
 
-// Print the status of the last foreground process to exit.
+// Print the status of the last foreground process to exit,
+// and what the last job to finish cost.
 void getStatus(){
     printf("exit value %d\n", currStatus.lastStatus);
+    if(currStatus.usageCount > 0 && currStatus.lastLimit != NULL) {
+        printf("last job: %s (stopped by %s)\n", currStatus.lastCommand, currStatus.lastLimit);
+        printUsage(stdout, &currStatus.lastUsage);
+    } else if(currStatus.usageCount > 0) {
+        printf("last job: %s\n", currStatus.lastCommand);
+        printUsage(stdout, &currStatus.lastUsage);
+    }
 }
 
-// LINKED LIST FOR STORING VARIABLES
-/* I chose a linked list as my data structure for the following reasons
- * 1. I don't have to prepare for the 512 argument at 2048 bytes limit as
- *     each node will be allocated at runtime.
- * 2. Since each command is calloc to each node, I am not worried about white
- *    space or other issues.
- * 3. Certain commands (such as expanding $$) are simple since I just need to 
- *    create the new command string and reallocate the memory to the new string.
- * 4. The only issue is that every search is O(N) and I do have to repeatedly 
- *    search to prepare my commands. I think this is an okay tradeoff for the
- *    benefits it allows me.
+// RESOURCE USAGE
+/* Every child is reaped with wait4, so its rusage comes back with its
+ * status. Foreground children add to currStatus.commandUsage and
+ * background children to their job. When a job is done its usage becomes
+ * the one shown by status and time.
  */
+void startUsage(struct jobUsage *usage) {
+    memset(usage, 0, sizeof(struct jobUsage));
+    usage->startNs = nowNs();
+}
 
-// Linked list node. Holds one command and a reference to the next
-// command.
-struct command{
-    char *command;
-    struct command *next;
-};
-
-// Creating the linked list node
-/* Citation for the following function: createCommand()
-   Date: 01/28/2022
-   Adapted from: Example program from Module 1 to create a linked list
-   Source URL: https://replit.com/@cs344/studentsc#main.c
-*/
-struct command *createCommand(char userCommand[]) {
-    /* This creates the linked list node for each command
-       before applying the command to the node in the linked
-       list, it will first verify of any expansion variables
-       and process those first.
-    */
+// Adds the rusage of one reaped process.
+void addUsage(struct jobUsage *usage, const struct rusage *part) {
+    struct rusage *total = &usage->rusage;
 
-    struct command *currCommand = malloc(sizeof(struct command));
-    
-    // Check for expansion variables $$
-    char *formattedCommand;
-    formattedCommand = expandVariablesToPid(userCommand);
+    timeradd(&total->ru_utime, &part->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &part->ru_stime, &total->ru_stime);
+    if(part->ru_maxrss > total->ru_maxrss) total->ru_maxrss = part->ru_maxrss;
+    total->ru_nvcsw += part->ru_nvcsw;
+    total->ru_nivcsw += part->ru_nivcsw;
+    usage->processes++;
+}
 
-    // Apply the formatted string to the node.
-    currCommand->command = calloc(strlen(formattedCommand)+1, sizeof(char));
-    strcpy(currCommand->command, formattedCommand);
-    currCommand->command[strlen(currCommand->command)] = '\0';
+// Stops the clock and keeps usage as the last job. Takes over commandLine.
+void recordUsage(struct jobUsage *usage, char *commandLine) {
+    usage->wallNs = nowNs() - usage->startNs;
+    currStatus.lastUsage = *usage;
+    free(currStatus.lastCommand);
+    currStatus.lastCommand = commandLine;
+    currStatus.usageCount++;
+}
 
-    currCommand->next = NULL;
+void printUsage(FILE *out, struct jobUsage *usage) {
+    struct rusage *total = &usage->rusage;
 
-    return currCommand;
+    fprintf(out, "real %lld.%03llds  user %ld.%03lds  sys %ld.%03lds  maxrss %ld KB  switches %ld voluntary %ld involuntary\n",
+            usage->wallNs / 1000000000, usage->wallNs / 1000000 % 1000,
+            (long)total->ru_utime.tv_sec, (long)total->ru_utime.tv_usec / 1000,
+            (long)total->ru_stime.tv_sec, (long)total->ru_stime.tv_usec / 1000,
+            total->ru_maxrss, total->ru_nvcsw, total->ru_nivcsw);
+}
 
+// PER LINE MEMORY
+/* Everything parsed from a line lives in one bump arena. Allocating is a
+ * pointer increment, and once the command has run the whole arena is reset
+ * in one step. The blocks are kept between lines, so once the arena has
+ * grown to fit the longest line a session sees, parsing never calls malloc
+ * again.
+ */
+struct arenaBlock {
+    struct arenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
 };
 
-// Creating the linked list.
-/* Citation for the following function: createCommandList()
-   Date: 01/28/2022
-   Adapted from: Example program from Module 1 to create a linked list
-   Source URL: https://replit.com/@cs344/studentsc#main.c
-*/
-struct command *createCommandList(char userInput[]) {
-    /* This is a linked list structure for the nodes */
-
-    // List head
-    struct command *head = NULL;
-    // List tail
-    struct command *tail = NULL;
+struct arena {
+    struct arenaBlock *head;
+    struct arenaBlock *current;
+};
 
-    char *savePtr;
-    char *token = strtok_r(userInput, " ", &savePtr);
+static struct arena lineArena = {NULL, NULL};
 
-    while(token != NULL) {
-        struct command *newCommand = createCommand(token);
+// Returns size bytes of 16 byte aligned memory that lasts until the reset.
+void *arenaAlloc(struct arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
 
-        if(head == NULL) {
-            head = newCommand;
-            tail = newCommand;
-        } else {
-            tail->next = newCommand;
-            tail = newCommand;
+    // Move on to the next kept block, or add one, when this one is full.
+    while(arena->current == NULL || arena->current->used + size > arena->current->size) {
+        if(arena->current != NULL && arena->current->next != NULL) {
+            arena->current = arena->current->next;
+            arena->current->used = 0;
+            continue;
         }
 
-        token = strtok_r(NULL, " ", &savePtr);
+        size_t blockSize = size > 65536 ? size : 65536;
+        struct arenaBlock *block = malloc(sizeof(struct arenaBlock) + blockSize);
+        block->next = NULL;
+        block->size = blockSize;
+        block->used = 0;
+        if(arena->current == NULL) arena->head = block;
+        else arena->current->next = block;
+        arena->current = block;
     }
 
-    free(userInput);
-    fflush(stdin);
-    fflush(stdout);
+    void *memory = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return memory;
+}
+
+// Frees everything allocated since the last reset, keeping the blocks.
+void arenaReset(struct arena *arena) {
+    arena->current = arena->head;
+    if(arena->current != NULL) arena->current->used = 0;
+}
 
-    return head;
+/* One stage of a pipeline. argv is NULL terminated. input and output are
+ * the < and > files, or NULL when the stage has none.
+ */
+struct stage {
+    char **argv;
+    int argc;
+    int capacity;
+    char *input;
+    char *output;
 };
 
-// CLEANING MEMORY AND PREPARING FOR THE NEXT COMMAND
-/* Cleaning a linked list is not as simple as freeing the head.
- * in order to ensure that my memory links for a command list are
- * taken care of. I need to go through each node and free the command string
- * before freeing the actual node.
+// How a command in a list depends on the one before it.
+enum listConnector { LIST_ALWAYS = 0, LIST_AND = 1, LIST_OR = 2 };
+
+/* One pipeline of a line. A plain command is a pipeline with a single
+ * stage. The commands of a line separated by ;, &, && and || are chained
+ * through next. listEnd is set on the first command of a list that runs
+ * as a single job, see runCommandList().
  */
-/* Citation for the following function: freeList()
-   Date: 01/28/2022
-   Adapted from: How to fix memory links of a linked list
-   Source URL: https://stackoverflow.com/questions/6417158/c-how-to-free-nodes-in-the-linked-list/6417182
-*/
-void freeList(struct command *list) {
-    /* 
-     * This will iterate through the linked list
-     * and free all the memory allocation.
-     * It works by visiting each node and freeing the allocation
-     * of the individual commands, and then releasing the linked list
-     * node.
-     */
-    struct command *temp;
+struct command{
+    struct stage *stages;
+    int stageCount;
+    int stageCapacity;
+    int background;
+    int connector;
+    struct command *next;
+    struct command *listEnd;
+};
 
-    while(list != NULL){
-        temp = list;
-        list = list->next;
-        free(temp->command);
-        free(temp);
+// Appends a word to argv, doubling the array inside the arena when full.
+void addArgument(struct stage *stage, char *word) {
+    if(stage->argc + 1 >= stage->capacity) {
+        int capacity = stage->capacity * 2;
+        char **argv = arenaAlloc(&lineArena, capacity * sizeof(char *));
+        memcpy(argv, stage->argv, stage->argc * sizeof(char *));
+        stage->argv = argv;
+        stage->capacity = capacity;
     }
+    stage->argv[stage->argc++] = word;
+    stage->argv[stage->argc] = NULL;
 }
 
-// This is responsible for flushing the buffers
-// and returning to the starting shell.
-// This process was repeated a lot so it made sense
-// to isolate it to its own function.
-void cleanMemoryAndReturnToShell(struct command *list) {
-    freeList(list);
-    fflush(stdin);
-    fflush(stdout);
-    startShell();
+// Starts a new empty stage at the end of the pipeline.
+struct stage *addStage(struct command *cmd) {
+    if(cmd->stageCount == cmd->stageCapacity) {
+        int capacity = cmd->stageCapacity == 0 ? 4 : cmd->stageCapacity * 2;
+        struct stage *stages = arenaAlloc(&lineArena, capacity * sizeof(struct stage));
+        if(cmd->stageCount > 0) memcpy(stages, cmd->stages, cmd->stageCount * sizeof(struct stage));
+        cmd->stages = stages;
+        cmd->stageCapacity = capacity;
+    }
+
+    struct stage *stage = &cmd->stages[cmd->stageCount++];
+    stage->capacity = 16;
+    stage->argv = arenaAlloc(&lineArena, stage->capacity * sizeof(char *));
+    stage->argv[0] = NULL;
+    stage->argc = 0;
+    stage->input = NULL;
+    stage->output = NULL;
+    return stage;
 }
 
+// LEXER
+/* The line is read once, left to right. Each word is copied into an
+ * output buffer in the arena as it is scanned, with quotes removed. The
+ * expansions are $$ (the shell's pid, formatted once at startup), $? (the
+ * last status), $! (the last background pid), $NAME or ${NAME} from the
+ * variable table, and $(command) with the output of the command. $$ never
+ * changes and is copied in place. A word with any other expansion is kept
+ * as written after a DEFERRED_WORD byte, and expandCommand() lexes it
+ * again just before its command runs. That way each command of a list
+ * sees what the ones before it did, and a command skipped by && or ||
+ * expands nothing. Each expansion is one hash lookup, so the work stays
+ * linear in the length of the line. Outside quotes the value of an
+ * expansion is split into separate words on blanks, and a word that
+ * expands to nothing at all is dropped.
+ * Unquoted |, <, >, ; and & end a word and are classified on the spot. ;
+ * ends a command and & ends one that runs in the background, wherever
+ * they are on the line, and && and || end one and make the next depend on
+ * its status. Text inside '' is taken as it is. Inside "" only $, \" \\
+ * and \$ are special, and outside quotes a \ keeps the next character as
+ * it is.
+ */
+struct lexer {
+    const char *input;
+    char *out;
+    char *end;
+    char *word;
+    int fields;         // words produced by the last lexWord()
+    int content;        // the word being built is kept even if empty
+    int expanded;       // the last word had a $ expansion other than $$ in it
+    int defer;          // parsing only, a $( ) is not run
+    int failed;         // a $( ) could not be run
+    char number[24];
+};
 
-// SHELL START AND VERIFICATION
-void startShell() {
-    /* Starts the user shell and requests input. All
-       user processes start at this function. */
+// Starts a word kept as written, to be expanded when its command runs.
+#define DEFERRED_WORD '\001'
 
-    /* In order to ensure my signal interrupts are
-     * handled correctly. I need to invoke them at
-     * startShell, runProcess, and redirectProcess.
-     * I spent some time exploring global variables but
-     * for me it just didn't work correctly. With some
-     * future refactoring I think I can discover a way
-     * to handle these correctly.
-     */
-    struct sigaction SIGINT_action = {{0}};
+// Set while a script is compiled, see SCRIPT CACHE, so $$ waits as well.
+static int compilingScript = 0;
 
-    sigfillset(&SIGINT_action.sa_mask);
+// Points the lexer at input, with an output buffer sized for it.
+void startLexer(struct lexer *lexer, const char *input) {
+    size_t length = strlen(input);
 
-    SIGINT_action.sa_flags = SA_RESTART;
+    lexer->input = input;
+    lexer->out = arenaAlloc(&lineArena, length + 64);
+    lexer->end = lexer->out + length + 64;
+    lexer->word = lexer->out;
+    lexer->defer = 0;
+    lexer->failed = 0;
+}
 
-    SIGINT_action.sa_handler = SIG_IGN;
-    sigaction(SIGINT, &SIGINT_action, NULL);
+/* Makes sure needed more bytes, plus room for the rest of the line, fit
+ * in the output buffer. Only the word being built moves if the buffer is
+ * replaced, words that are already finished stay where they are.
+ */
+void reserveOutput(struct lexer *lexer, size_t needed) {
+    if(lexer->out + needed <= lexer->end) return;
 
-    SIGINT_action.sa_handler = toggleForegroundMode;
-    sigaction(SIGTSTP, &SIGINT_action, NULL);
+    size_t partial = lexer->out - lexer->word;
+    size_t size = partial + needed + strlen(lexer->input) + 64;
+    char *buffer = arenaAlloc(&lineArena, size);
 
-    fflush(stdin);
-    fflush(stdout);
+    memcpy(buffer, lexer->word, partial);
+    lexer->word = buffer;
+    lexer->out = buffer + partial;
+    lexer->end = buffer + size;
+}
+
+// Characters that end an unquoted word.
+int isWordEnd(char c) {
+    return c == '\0' || c == ' ' || c == '\t' || c == '|' || c == '<' || c == '>' || c == ';' || c == '&';
+}
+
+/* Returns the value of the expansion starting at the $ at p and sets next
+ * past it, or returns NULL when the $ is just a character. Unset variables
+ * and ${ with no } expand to nothing.
+ */
+const char *expandDollar(struct lexer *lexer, const char *p, const char **next) {
+    const char *name = p + 1;
+    size_t length;
+
+    if(*name == '$') {
+        *next = p + 2;
+        return currStatus.pidString;
+    }
+    if(*name == '?' || *name == '!') {
+        *next = p + 2;
+        if(*name == '!' && currStatus.lastBackground == 0) return "";
+        snprintf(lexer->number, sizeof(lexer->number), "%d", *name == '?' ? currStatus.lastStatus : currStatus.lastBackground);
+        return lexer->number;
+    }
+    if(*name == '{') {
+        const char *close = strchr(++name, '}');
+        if(close == NULL) {
+            *next = name + strlen(name);
+            return "";
+        }
+        *next = close + 1;
+        const char *value = getVariable(name, close - name);
+        return value == NULL ? "" : value;
+    }
+    if(*name == '(') {
+        const char *close = findClosingParen(name + 1);
+        if(close == NULL) {
+            fprintf(stderr, "syntax error: missing )\n");
+            lexer->failed = 1;
+            *next = name + strlen(name);
+            return "";
+        }
+        *next = close + 1;
+        if(lexer->defer) return "";
 
-    checkPid(); // Used to track background pid's exit status.
+        char *text = arenaAlloc(&lineArena, close - name);
+        memcpy(text, name + 1, close - name - 1);
+        text[close - name - 1] = '\0';
+        return captureOutput(text);
+    }
+    if(*name >= '0' && *name <= '9') {
+        *next = name + 1;
+        return "";
+    }
+    length = nameLength(name);
+    if(length == 0) return NULL;
 
-    /* Start the interactive shell */
-    char* userInput;
-    int verified;
+    *next = name + length;
+    const char *value = getVariable(name, length);
+    return value == NULL ? "" : value;
+}
 
-    userInput = getUserInput();
-    // This verifies whether a user inputs a comment or a blank space.
-    verified = verifyUserInput(userInput);
+/* Copies an expanded value into the word. Outside quotes, blanks in the
+ * value end the word and start a new one, each terminated in place.
+ */
+void appendExpansion(struct lexer *lexer, const char *value, int quoted) {
+    size_t length = strlen(value);
 
-    if(verified == -1){
-        free(userInput);
-        fflush(stdin);
-        fflush(stdout);
-        startShell();
-    } else {
-       struct command *list = createCommandList(userInput);
-       activateCommands(list);
+    reserveOutput(lexer, length + 1);
+    if(quoted) {
+        memcpy(lexer->out, value, length);
+        lexer->out += length;
+        return;
+    }
+    for(size_t i = 0; i < length; i++) {
+        if(value[i] == ' ' || value[i] == '\t' || value[i] == '\n') {
+            if(lexer->content) {
+                *lexer->out++ = '\0';
+                lexer->fields++;
+                lexer->content = 0;
+            }
+        } else {
+            *lexer->out++ = value[i];
+            lexer->content = 1;
+        }
     }
 }
 
-/* Gathers the user input as a solid string for parsing */
-char* getUserInput(){
-    /* 
-     * Get the line of user commands 
-     * returns the entire line as a
-     * string
-     */
+/* Copies one word from the input into the arena. Expansions can make it
+ * zero or more words, lexer->fields of them, stored one after another.
+ */
+char *lexWord(struct lexer *lexer) {
+    const char *p = lexer->input;
+    const char *value, *next;
+    char quote = '\0';
 
-    fflush(stdin);
-    fflush(stdout);
+    lexer->word = lexer->out;
+    lexer->fields = 0;
+    lexer->content = 0;
+    lexer->expanded = 0;
 
-    char *input = NULL;
-    size_t len = 0;
+    while(*p != '\0' && (quote != '\0' || !isWordEnd(*p))) {
+        char c = *p;
 
-    printf(":");
-    int read = getline(&input, &len, stdin);
-    input[read-1] = '\0';
+        if(quote == '\0' && (c == '\'' || c == '"')) {
+            quote = c;
+            lexer->content = 1;
+            p++;
+        } else if(c == quote) {
+            quote = '\0';
+            p++;
+        } else if(c == '$' && quote != '\'' && (value = expandDollar(lexer, p, &next)) != NULL) {
+            if(p[1] != '$' || compilingScript) lexer->expanded = 1;
+            lexer->input = next;
+            appendExpansion(lexer, value, quote == '"');
+            p = next;
+        } else if(c == '\\' && p[1] != '\0' && quote != '\'' &&
+                  (quote == '\0' || p[1] == '"' || p[1] == '\\' || p[1] == '$')) {
+            *lexer->out++ = p[1];
+            lexer->content = 1;
+            p += 2;
+        } else {
+            *lexer->out++ = c;
+            lexer->content = 1;
+            p++;
+        }
+    }
+    if(lexer->content) {
+        *lexer->out++ = '\0';
+        lexer->fields++;
+    }
+    lexer->input = p;
 
-    return input;
+    if(quote != '\0') {
+        fprintf(stderr, "syntax error: unterminated %c\n", quote);
+        return NULL;
+    }
+    return lexer->failed ? NULL : lexer->word;
 }
 
-/* Verifies whether the initial value is a #
- * denoting a comment, or a \0 which verifies
- * a blank line
- */
-int verifyUserInput(char userInput[]) {
-    /* 
-     * Verify the the user input is either 
-     * a blank line or a comment
-     */
+// Starts an empty command in the arena with one empty stage.
+struct command *newCommand(int connector) {
+    struct command *cmd = arenaAlloc(&lineArena, sizeof(struct command));
 
-    if(userInput[0] == '\0' || userInput[0] == '#') return -1;
-    else return 1;
+    cmd->stages = NULL;
+    cmd->stageCount = 0;
+    cmd->stageCapacity = 0;
+    cmd->background = 0;
+    cmd->connector = connector;
+    cmd->next = NULL;
+    cmd->listEnd = NULL;
+    addStage(cmd);
+    return cmd;
 }
 
-/* Activate commands handles both the built in processes and routes
- * the executable processes.
+/* Turns one line into a chain of parsed commands, one for each part
+ * between ;, &, && and ||. Returns NULL after printing a message if the
+ * line is malformed. A redirect with no file after it is routed to
+ * /dev/null.
  */
-void activateCommands(struct command *list) {
-    /* Examines the first command of the linked list
-       if the first command is one of the built in
-       commands, it will perform the built in action
-       other commands will be sent to be parsed by 
-       the execution functions */
+struct command *createCommandList(char userInput[]) {
+    struct command *first = newCommand(LIST_ALWAYS);
+    struct command *cmd = first;
+    struct stage *stage = &cmd->stages[0];
+    struct lexer lexer;
+    char **pending = NULL;
 
-    if(strcmp(list->command, "exit") == 0) {
-        freeList(list);
-        fflush(stdout);
-        exit(0);
-    } else if (strcmp(list->command, "cd") == 0){
-        changeDirectory(list);
-        cleanMemoryAndReturnToShell(list);
-    } else if(strcmp(list->command, "status") == 0){
-        getStatus();
-        cleanMemoryAndReturnToShell(list);
-    } else {
-        // Verify first if there is a & at the end of the list
-        int checkBackground = verifyBackgroundProcessRequest(list);
-        // Verify if any < or > are present to signify a redirect
-        int checkRedirect = verifyIfChildRedirect(list);
+    startLexer(&lexer, userInput);
+    lexer.defer = 1;
 
-        // Follows a global variable
-        if(currStatus.foregroundOnlyMode == 1) {
-            checkBackground = 0;
+    while(1) {
+        while(*lexer.input == ' ' || *lexer.input == '\t') lexer.input++;
+
+        char c = *lexer.input;
+        if(c == '\0') break;
+
+        if(c == ';' || c == '&' || (c == '|' && lexer.input[1] == '|')) {
+            int connector = LIST_ALWAYS;
+
+            if(c != ';' && lexer.input[1] == c) connector = c == '&' ? LIST_AND : LIST_OR;
+            if(pending != NULL) *pending = "/dev/null";
+            pending = NULL;
+            if(stage->argc == 0) {
+                fprintf(stderr, "syntax error near %.*s\n", connector == LIST_ALWAYS ? 1 : 2, lexer.input);
+                return NULL;
+            }
+            if(c == '&' && connector == LIST_ALWAYS) cmd->background = 1;
+            lexer.input += connector == LIST_ALWAYS ? 1 : 2;
+
+            // ; and & can end the line, && and || need a command after them.
+            while(*lexer.input == ' ' || *lexer.input == '\t') lexer.input++;
+            if(*lexer.input == '\0' && connector == LIST_ALWAYS) break;
+            cmd->next = newCommand(connector);
+            cmd = cmd->next;
+            stage = &cmd->stages[0];
+            continue;
         }
 
-        if(checkRedirect == 0){
-            runProcess(list, checkBackground);
-        } else if(checkRedirect == 1) {
-            redirectProcess(list, checkBackground);
+        if(c == '|' || c == '<' || c == '>') {
+            if(pending != NULL) *pending = "/dev/null";
+            pending = NULL;
+            lexer.input++;
+
+            if(c == '<') pending = &stage->input;
+            else if(c == '>') pending = &stage->output;
+            else if(stage->argc == 0) {
+                fprintf(stderr, "syntax error near |\n");
+                return NULL;
+            } else {
+                stage = addStage(cmd);
+            }
+            continue;
+        }
+
+        const char *start = lexer.input;
+        char *word = lexWord(&lexer);
+        if(word == NULL) return NULL;
+
+        // A word that could be taken for a deferred one is deferred too.
+        if(lexer.expanded || word[0] == DEFERRED_WORD) {
+            size_t length = lexer.input - start;
+
+            word = arenaAlloc(&lineArena, length + 2);
+            word[0] = DEFERRED_WORD;
+            memcpy(word + 1, start, length);
+            word[length + 1] = '\0';
+            lexer.fields = 1;
+        }
+        if(pending != NULL) {
+            if(lexer.fields != 1) {
+                fprintf(stderr, "syntax error: ambiguous redirect\n");
+                return NULL;
+            }
+            *pending = word;
+            pending = NULL;
+            continue;
+        }
+        for(int i = 0; i < lexer.fields; i++) {
+            addArgument(stage, word);
+            word += strlen(word) + 1;
         }
-        cleanMemoryAndReturnToShell(list);
     }
-}
+    if(pending != NULL) *pending = "/dev/null";
+
+    if(stage->argc == 0 && (cmd->stageCount > 1 || stage->input != NULL || stage->output != NULL || cmd != first)) {
+        fprintf(stderr, cmd->stageCount > 1 ? "syntax error near |\n" : "syntax error: missing command\n");
+        return NULL;
+    }
+    return first;
+};
 
-// VERIFICATION BEFORE FORKING
-/* Using the strength of my linked list. I know that if I 
- * look at the last node (where currList->next == NULL) and
- * it is a &, then this is supposed to be a background process.
+/* Expands the deferred words of one command, just before it runs.
+ * Returns -1 after printing a message if an expansion fails, or leaves a
+ * redirect with other than one word or a pipeline stage with none.
  */
-int verifyBackgroundProcessRequest(struct command *list) {
-    /* Verifies whether a process has been
-     * signaled as a foreground or background process
-     */
-    struct command *currList = list;
+int expandCommand(struct command *cmd) {
+    for(int i = 0; i < cmd->stageCount; i++) {
+        struct stage *stage = &cmd->stages[i];
+        char **words = stage->argv;
+        int count = stage->argc, deferred = 0;
+
+        for(int j = 0; j < count; j++) {
+            if(words[j][0] == DEFERRED_WORD) deferred = 1;
+        }
+        if(deferred) {
+            stage->capacity = count + 16;
+            stage->argv = arenaAlloc(&lineArena, stage->capacity * sizeof(char *));
+            stage->argv[0] = NULL;
+            stage->argc = 0;
+            for(int j = 0; j < count; j++) {
+                if(expandWord(words[j], stage, NULL) == -1) return -1;
+            }
+        }
+        if(expandWord(stage->input, NULL, &stage->input) == -1 ||
+           expandWord(stage->output, NULL, &stage->output) == -1) return -1;
 
-    while(currList->next != NULL) currList = currList->next;
-    if(strcmp(currList->command, "&") == 0) return 1;
+        if(stage->argc == 0 && (cmd->stageCount > 1 || stage->input != NULL || stage->output != NULL)) {
+            fprintf(stderr, cmd->stageCount > 1 ? "syntax error near |\n" : "syntax error: missing command\n");
+            return -1;
+        }
+    }
     return 0;
 }
 
-/* Similar to the background process. I search to find any instances
- * of < or > which triggers a redirect.
+/* Adds word to the argv of stage, or sets *redirect to it, expanding it
+ * first if it was deferred.
  */
-int verifyIfChildRedirect(struct command *list) {
-    /* Verfies if there is a redirect command > or <.
-     * it will also verify that immediately after the 
-     * redirect command, that there is a filename to 
-     * redirect to.
-     */
-    
-    struct command *currList = list;
+int expandWord(char *word, struct stage *stage, char **redirect) {
+    struct lexer lexer;
 
-    while(currList != NULL) {
-        if(strcmp(currList->command, "<") == 0 || strcmp(currList->command, ">") == 0) {
-            if(currList->next != NULL) {
-                return 1;
-            }
+    if(word == NULL) return 0;
+    lexer.fields = 1;
+    if(word[0] == DEFERRED_WORD) {
+        startLexer(&lexer, word + 1);
+        word = lexWord(&lexer);
+        if(word == NULL) return -1;
+    }
+
+    if(redirect != NULL) {
+        if(lexer.fields != 1) {
+            fprintf(stderr, "syntax error: ambiguous redirect\n");
+            return -1;
         }
-        currList = currList->next;
+        *redirect = word;
+        return 0;
+    }
+    for(int i = 0; i < lexer.fields; i++) {
+        addArgument(stage, word);
+        word += strlen(word) + 1;
     }
     return 0;
 }
 
-// USER COMMANDS AFTER VERIFICATION
+// COMMAND SUBSTITUTION
+/* $(command) is run when the words of its command are expanded, just
+ * before that command runs, and its output takes its place in the word,
+ * split into words like a variable's value unless it is inside "". The
+ * output is read from a pipe into a buffer that doubles as it fills, so
+ * nothing touches the disk. A single program is started directly with the
+ * pipe as its stdout. Pipelines and builtins are run by a fork of the
+ * shell, never by another interpreter. A nested $( ) is expanded when the
+ * inner command runs, so each level costs one child and no more.
+ */
 
-/* Citation for the following function: changeDirectory()
-   Date: 01/28/2022
-   Adapted from: clarification on how to find a path of unknown value
-   Source URL: https://stackoverflow.com/questions/298510/how-to-get-the-current-directory-in-a-c-program
-*/
-void changeDirectory(struct command *list) {
-    /* Depending on the context of the command
-     * this will change the directory.
-     * cd -> will go to $HOME
-     * cd /[directory] -> will search and go to the directory
-     * cd [directory] -> will sanitize the entry and go to the directory
-     * if the directory doesn't exist an error will print.
-     */
-    char *envPath;
-    int changeDir;
+// Returns the ) that closes a $( whose text starts at p, or NULL.
+const char *findClosingParen(const char *p) {
+    char quote = '\0';
+    int depth = 1;
 
-    // Path into the $HOME directory
-    if(list->next == NULL){
-        envPath = getenv("HOME");
-        changeDir = chdir(envPath);
-        if(changeDir == -1){
-            perror("chdir() failure: \n");
-        } 
-    } else {
-        list = list->next;
-        // Path into an absolute path startin with /
-        if(list->command[0] == '/') {
-            changeDir = chdir(list->command);
-            if(changeDir == -1){
-                perror("chdir() failure: \n");
-            }
-        } else {
-            // Path into a relative directory.
-            envPath = calloc(strlen(list->command) + 3, sizeof(char));
-            sprintf(envPath, "./%s", list->command);
-            changeDir = chdir(envPath);
-            if(changeDir == -1){
-                perror("chdir() failure: \n");
-            }
-            free(envPath);
-        }   
+    for(; *p != '\0'; p++) {
+        if(quote != '\0') {
+            if(*p == quote) quote = '\0';
+            else if(*p == '\\' && quote == '"' && p[1] != '\0') p++;
+        } else if(*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if(*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if(*p == '(') {
+            depth++;
+        } else if(*p == ')' && --depth == 0) {
+            return p;
+        }
     }
+    return NULL;
 }
 
-/* I needed the length of the PID to know how much memory to allocate
- * this was a helpful function to accomplish this.
+/* Runs the command line in text and returns what it wrote to stdout, in
+ * the arena, without its trailing newlines. Its status becomes $?.
  */
-/* Citation for the following function: getLengthOfPID()
-   Date: 01/29/2022
-   Adapted from: How to get the length of an integer
-   Source URL: https://stackoverflow.com/questions/8257714/how-to-convert-an-int-to-string-in-c
-   */
-int getLengthOfPID(pid_t pid){
-    return snprintf(NULL, 0, "%d", pid);
-}
-
-/* This will search the command for any instances of $
- * if there are two in a row, then it will replace that
- * with the pid. Otherwise it will return the command.
- * Due to some issues with parsing the userCommand with 
- * a for loop to the sizeof the command. It would bleed into
- * the memory of the next command. I ended up choosing
- * to parse through using a pointer which fixed the issue.
- */
-/* Citation for the following function: expandVariablesToPid()
-   Date: 01/29/2022
-   Adapted from: How to turn an integer into a string
-   Source URL: https://stackoverflow.com/questions/8257714/how-to-convert-an-int-to-string-in-c 
-*/
-// Expand all instances of $$ to the pid of the parent
-char* expandVariablesToPid(char *userCommand) {
-    /* Any instance of $$ in a variable is transformed into
-     * the pid of the parent
-     */
-    char *formattedChar;
-    pid_t parentPID = getpid();
-    int lengthOfParentPID = getLengthOfPID(parentPID);
-    char *ptr;
-    int count = 0;
+char *captureOutput(char *text) {
+    struct command *cmd = createCommandList(text);
+    struct stage *first;
+    int pipeFDs[2];
+    pid_t pid = -1;
 
-    // Counts the number of $ in the command
-    ptr = userCommand;
-
-    while(*ptr != '\0') {
-        if(*ptr == '$') count++;
-        ptr++;
-    }
-
-    // If we have at least 2 $ then perform the variable expansion.
-    ptr = userCommand;
-    
-    if(count >= 2) {
-        int flag = 0; // This flag is used to determine if 2 $ are next to one another.
-
-        // Turn the pid into a string for concatenation
-        char *tempPID = calloc(lengthOfParentPID + 1, sizeof(char)); 
-        sprintf(tempPID, "%d", parentPID);
-        
-        char *tempString = calloc(strlen(userCommand) + ((count * lengthOfParentPID)) + 1, sizeof(char));
-
-        while(*ptr != '\0'){
-            // We have found a char '$' in the string
-            if (*ptr == '$') {
-                // If the previous char was '$' concat the pid to the string.
-                if(flag == 1) {
-                    sprintf(tempString, "%s%s", tempString, tempPID);
-                    flag = 0;
-                // Otherwise we increment our flag and check the next char
-                } else {
-                    flag = 1;
-                }
-            // If the next char is not a $
-            } else {
-                // Verify if the previous char was a $, if so, we concat a $ and add the next char
-                if(flag == 1) {
-                    sprintf(tempString, "%s%c", tempString, '$');
-                    flag = 0;
-                }
-                    sprintf(tempString, "%s%c", tempString, *ptr);
-            }
-           ptr++;
+    if(cmd == NULL) {
+        currStatus.lastStatus = 1;
+        return "";
+    }
+    // A single command is expanded now, the parts of a list as they run.
+    if(cmd->next == NULL && expandCommand(cmd) == -1) {
+        currStatus.lastStatus = 1;
+        return "";
+    }
+    first = &cmd->stages[0];
+    if(first->argc == 0) return "";
+    if(pipe2(pipeFDs, O_CLOEXEC) == -1) {
+        perror("pipe2()");
+        currStatus.lastStatus = 1;
+        return "";
+    }
+
+    if(cmd->next == NULL && cmd->stageCount == 1 && !cmd->background && !isShellCommand(first->argv[0]) &&
+       findBuiltin(first->argv[0]) == NULL && isAssignment(first->argv[0]) == 0) {
+        struct launchRequest request = {first->argv, -1, -1, 0, -1};
+
+        if(openRedirects(first->input, first->output, &request.inputFD, &request.outputFD) == 0) {
+            if(request.outputFD == -1) request.outputFD = pipeFDs[1];
+            pid = startChild(&request);
+            if(request.inputFD != -1) close(request.inputFD);
+            if(request.outputFD != pipeFDs[1]) close(request.outputFD);
+        }
+    } else {
+        fflush(stdout);
+        pid = fork();
+        if(pid == 0) {
+            forgetTrace();
+            currStatus.forked = 1;
+            dup2(pipeFDs[1], STDOUT_FILENO);
+            close(pipeFDs[0]);
+            close(pipeFDs[1]);
+            runCommandList(cmd);
+            fflush(stdout);
+            _exit(currStatus.lastStatus);
+        }
+        if(pid == -1) {
+            perror("fork()");
+            currStatus.lastStatus = 1;
         }
-        // This is here to catch a trailing $ which could be discarded if a pid was
-        // put in before it appeared. It's a small but annoying edge case.
-        if(flag == 1) {
-            sprintf(tempString, "%s%c", tempString, '$');
+    }
+    close(pipeFDs[1]);
+
+    size_t length = 0, capacity = 4096;
+    char *buffer = malloc(capacity);
+    ssize_t bytes;
+    while((bytes = read(pipeFDs[0], buffer + length, capacity - length - 1)) != 0) {
+        if(bytes == -1) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        length += bytes;
+        if(capacity - length < 1024) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
         }
-        // Free the allocated memory of command and replace it with the new string
-        formattedChar = calloc(strlen(tempString) + 3,sizeof(char));
-        sprintf(formattedChar, "%s", tempString);
-        free(tempPID);
-        free(tempString);
-        return formattedChar;
     }
+    close(pipeFDs[0]);
+    if(pid > 0) waitForeground(pid);
 
-    return userCommand;
+    while(length > 0 && buffer[length - 1] == '\n') length--;
+    char *output = arenaAlloc(&lineArena, length + 1);
+    memcpy(output, buffer, length);
+    output[length] = '\0';
+    free(buffer);
+    return output;
 }
 
-// FILE REDIRECTION FUNCTIONS
-/* Citation for the following function: redirectProcess()
-   Date: 01/30/2022
-   Adapted from: How to perform file redirection in modules
-   Source URL: https://canvas.oregonstate.edu/courses/1884946/pages/exploration-processes-and-i-slash-o?module_item_id=21835982
-   */
-/* Citation for the following function: redirectProcess()
-   Date: 01/30/2022
-   Adapted from: how to check status on child failure/completion
-   Source URL: https://stackoverflow.com/questions/13735501/fork-exec-waitpid-issue
-*/
-void redirectProcess(struct command *list, int type) {
-    /* This is for process redirect of an input file or output file or both.
-     * It works by first pulling the command from the first node in the linked
-     * list, then inspecting the other nodes for an instance of the redirect command
-     * and the file following it. Once it is processed, depending on the flags
-     * (inputFlag will trigger if there is an input file and outputFlag will trigger)
-     * if there is an output file. The program will fork and perform the redirection 
-     * with dup2().
-     */
+// SHELL VARIABLES
+/* Variables live in an open addressing hash table with linear probing,
+ * each entry one "name=value" string so an exported one can go straight
+ * into the environment. The environment handed to children is an array of
+ * the exported entries. It is only rebuilt by syncEnvironment() after an
+ * exported variable changed, and environ is pointed at it so getenv() in
+ * the shell sees the same values as the children.
+ *
+ *   NAME=value ...          set variables, kept exported if they were
+ *   NAME=value ... command  run command with them exported, then restore
+ *   export [NAME[=value]]   export variables, or list the exported ones
+ *   unset NAME ...          remove variables
+ */
+struct variable {
+    char *pair;
+    size_t nameLength;
+    unsigned int hash;
+    int exported;
+};
 
-    char *input;
-    char *output;
-    char *commands[513];
-    int i = 0;
-    int inputFlag = 0;
-    int outputFlag = 0;
-    int hasInput = 0;
-    int hasOutput = 0;
+struct variableTable {
+    struct variable *entries;
+    int capacity;
+    int count;
+    char **environment;
+    int environmentChanged;
+};
 
-    /* The signal commands needed to be re-done due to them being local variables*/
-    struct command *currList = list;
+static struct variableTable variables = {NULL, 0, 0, NULL, 0};
 
-    struct sigaction SIGINT_action = {{0}};
+// FNV-1a hash of length bytes, the same as hashString() on a whole string.
+unsigned int hashBytes(const char *bytes, size_t length) {
+    unsigned int hash = 2166136261u;
 
-    sigfillset(&SIGINT_action.sa_mask);
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct variable *findVariable(const char *name, size_t length) {
+    if(variables.capacity == 0) return NULL;
+
+    unsigned int hash = hashBytes(name, length);
+    int mask = variables.capacity - 1;
+    for(int slot = hash & mask; variables.entries[slot].pair != NULL; slot = (slot + 1) & mask) {
+        struct variable *entry = &variables.entries[slot];
+        if(entry->hash == hash && entry->nameLength == length && memcmp(entry->pair, name, length) == 0) return entry;
+    }
+    return NULL;
+}
+
+const char *getVariable(const char *name, size_t length) {
+    struct variable *entry = findVariable(name, length);
+    return entry == NULL ? NULL : entry->pair + entry->nameLength + 1;
+}
+
+/* Sets a variable. exported is 1 or 0 to change whether it is exported, or
+ * -1 to keep it as it is (a new variable is not exported).
+ */
+void setVariable(const char *name, size_t length, const char *value, int exported) {
+    struct variable *entry = findVariable(name, length);
+    size_t valueLength = strlen(value);
+    char *pair = malloc(length + valueLength + 2);
+
+    memcpy(pair, name, length);
+    pair[length] = '=';
+    memcpy(pair + length + 1, value, valueLength + 1);
+
+    if(entry == NULL) {
+        // Grow at 3/4 full, rehashing every entry into the new table.
+        if((variables.count + 1) * 4 > variables.capacity * 3) {
+            struct variable *old = variables.entries;
+            int oldCapacity = variables.capacity;
+
+            variables.capacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+            variables.entries = calloc(variables.capacity, sizeof(struct variable));
+            for(int i = 0; i < oldCapacity; i++) {
+                if(old[i].pair == NULL) continue;
+                int slot = old[i].hash & (variables.capacity - 1);
+                while(variables.entries[slot].pair != NULL) slot = (slot + 1) & (variables.capacity - 1);
+                variables.entries[slot] = old[i];
+            }
+            free(old);
+        }
+
+        unsigned int hash = hashBytes(name, length);
+        int slot = hash & (variables.capacity - 1);
+        while(variables.entries[slot].pair != NULL) slot = (slot + 1) & (variables.capacity - 1);
+        entry = &variables.entries[slot];
+        entry->nameLength = length;
+        entry->hash = hash;
+        entry->exported = 0;
+        variables.count++;
+    } else {
+        free(entry->pair);
+    }
+
+    entry->pair = pair;
+    if(exported != -1) {
+        if(entry->exported != exported) variables.environmentChanged = 1;
+        entry->exported = exported;
+    }
+    if(entry->exported) variables.environmentChanged = 1;
+}
+
+// Removes a variable, shifting later entries back into the hole.
+void unsetVariable(const char *name, size_t length) {
+    struct variable *entry = findVariable(name, length);
+    if(entry == NULL) return;
+
+    int mask = variables.capacity - 1;
+    int slot = entry - variables.entries;
+
+    if(entry->exported) variables.environmentChanged = 1;
+    free(entry->pair);
+    entry->pair = NULL;
+    variables.count--;
+
+    for(int next = (slot + 1) & mask; variables.entries[next].pair != NULL; next = (next + 1) & mask) {
+        int home = variables.entries[next].hash & mask;
+        if(((next - home) & mask) >= ((next - slot) & mask)) {
+            variables.entries[slot] = variables.entries[next];
+            variables.entries[next].pair = NULL;
+            slot = next;
+        }
+    }
+}
+
+// Every variable the shell was started with is exported.
+void importEnvironment() {
+    for(char **variable = environ; *variable != NULL; variable++) {
+        char *equals = strchr(*variable, '=');
+        if(equals != NULL) setVariable(*variable, equals - *variable, equals + 1, 1);
+    }
+    syncEnvironment();
+}
+
+void syncEnvironment() {
+    int count = 0;
+
+    if(!variables.environmentChanged) return;
+    variables.environment = realloc(variables.environment, (variables.count + 1) * sizeof(char *));
+    for(int i = 0; i < variables.capacity; i++) {
+        if(variables.entries[i].pair != NULL && variables.entries[i].exported) {
+            variables.environment[count++] = variables.entries[i].pair;
+        }
+    }
+    variables.environment[count] = NULL;
+    environ = variables.environment;
+    variables.environmentChanged = 0;
+}
+
+// Returns the length of the variable name at the start of text, or 0.
+size_t nameLength(const char *text) {
+    size_t length = 0;
+
+    if(!(text[0] == '_' || (text[0] >= 'a' && text[0] <= 'z') || (text[0] >= 'A' && text[0] <= 'Z'))) return 0;
+    while(text[length] == '_' || (text[length] >= 'a' && text[length] <= 'z') ||
+          (text[length] >= 'A' && text[length] <= 'Z') || (text[length] >= '0' && text[length] <= '9')) {
+        length++;
+    }
+    return length;
+}
+
+// Returns the length of the name if word is NAME=value, otherwise 0.
+size_t isAssignment(const char *word) {
+    size_t length = nameLength(word);
+    return length > 0 && word[length] == '=' ? length : 0;
+}
+
+/* The first assignments words of the command are NAME=value. On their own
+ * they set shell variables. In front of a command they are exported for
+ * that command only and put back afterwards.
+ */
+void runWithAssignments(struct command *cmd, int assignments) {
+    struct stage *first = &cmd->stages[0];
+    char **names = arenaAlloc(&lineArena, assignments * sizeof(char *));
+    char **saved = arenaAlloc(&lineArena, assignments * sizeof(char *));
+    int *savedExported = arenaAlloc(&lineArena, assignments * sizeof(int));
+
+    if(assignments == first->argc) {
+        for(int i = 0; i < assignments; i++) {
+            size_t length = isAssignment(first->argv[i]);
+            setVariable(first->argv[i], length, first->argv[i] + length + 1, -1);
+        }
+        syncEnvironment();
+        currStatus.lastStatus = 0;
+        return;
+    }
+
+    for(int i = 0; i < assignments; i++) {
+        size_t length = isAssignment(first->argv[i]);
+        struct variable *entry = findVariable(first->argv[i], length);
+
+        names[i] = first->argv[i];
+        saved[i] = entry == NULL ? NULL : strdup(entry->pair);
+        savedExported[i] = entry == NULL ? 0 : entry->exported;
+        setVariable(first->argv[i], length, first->argv[i] + length + 1, 1);
+    }
+    first->argv += assignments;
+    first->argc -= assignments;
+    syncEnvironment();
+
+    activateCommands(cmd);
+
+    for(int i = assignments - 1; i >= 0; i--) {
+        size_t length = isAssignment(names[i]);
+        if(saved[i] == NULL) {
+            unsetVariable(names[i], length);
+        } else {
+            setVariable(names[i], length, saved[i] + length + 1, savedExported[i]);
+            free(saved[i]);
+        }
+    }
+    syncEnvironment();
+}
+
+void exportCommand(struct stage *stage) {
+    currStatus.lastStatus = 0;
+
+    if(stage->argc == 1) {
+        for(int i = 0; i < variables.capacity; i++) {
+            struct variable *entry = &variables.entries[i];
+            if(entry->pair == NULL || !entry->exported) continue;
+            printf("export %.*s=\"%s\"\n", (int)entry->nameLength, entry->pair, entry->pair + entry->nameLength + 1);
+        }
+        return;
+    }
+
+    for(int i = 1; i < stage->argc; i++) {
+        char *word = stage->argv[i];
+        size_t length = isAssignment(word);
+
+        if(length > 0) {
+            setVariable(word, length, word + length + 1, 1);
+            continue;
+        }
+        length = strlen(word);
+        struct variable *entry = findVariable(word, length);
+        if(entry != NULL) {
+            if(!entry->exported) variables.environmentChanged = 1;
+            entry->exported = 1;
+        } else if(length > 0 && nameLength(word) == length) {
+            setVariable(word, length, "", 1);
+        } else {
+            fprintf(stderr, "export: %s: not a valid name\n", word);
+            currStatus.lastStatus = 1;
+        }
+    }
+    syncEnvironment();
+}
+
+void unsetCommand(struct stage *stage) {
+    for(int i = 1; i < stage->argc; i++) unsetVariable(stage->argv[i], strlen(stage->argv[i]));
+    syncEnvironment();
+    currStatus.lastStatus = 0;
+}
+
+// SHELL START AND VERIFICATION
+// Signal dispositions and settings shared by every way of running the shell.
+void initShell() {
+    struct sigaction SIGINT_action = {{0}};
+
+    sigfillset(&SIGINT_action.sa_mask);
+
+    SIGINT_action.sa_flags = SA_RESTART;
+
+    SIGINT_action.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &SIGINT_action, NULL);
+
+    // Handing the terminal back from a pipeline raises SIGTTOU.
+    sigaction(SIGTTOU, &SIGINT_action, NULL);
+
+    SIGINT_action.sa_handler = toggleForegroundMode;
+    sigaction(SIGTSTP, &SIGINT_action, NULL);
+
+    initSettings();
+    importEnvironment();
+    watchChildren();
+    openTrace();
+}
+
+int startShell(struct inputSource *source) {
+    /* Starts the user shell and requests input. All
+       user processes start at this function. */
+
+    /* This is the main read-eval loop. Each pass reads one line,
+     * runs it and frees everything it allocated before coming back
+     * to the top, so the stack and heap stay the same size no matter
+     * how many commands a session runs. Built in commands and child
+     * processes simply return here when they are finished.
+     */
+    initShell();
+
+    while(1) {
+        checkPid(); // Used to track background pid's exit status.
+
+        /* Start the interactive shell */
+        char* userInput;
+        int verified;
+        long long started = traceStart();
+
+        // A compiled script hands over its lines already parsed, see SCRIPT CACHE.
+        if(source->kind == INPUT_CACHED) {
+            if(source->position >= source->length) break;
+            struct command *cmd = nextCachedLine(source);
+            traceEnd("parse", started, 0);
+            runLine(cmd);
+            arenaReset(&lineArena);
+            continue;
+        }
+
+        userInput = getUserInput(source);
+        traceEnd("read-line", started, 0);
+        // End of input behaves the same as the exit command.
+        if(userInput == NULL) break;
+
+        // This verifies whether a user inputs a comment or a blank space.
+        verified = verifyUserInput(userInput);
+
+        if(verified == -1) continue;
+
+        // Lines typed at the prompt go into the history, after ! recall.
+        if(source->kind == INPUT_TERMINAL) {
+            userInput = expandHistory(userInput);
+            if(userInput == NULL) {
+                currStatus.lastStatus = 1;
+                continue;
+            }
+            addHistory(userInput);
+        }
+
+        started = traceStart();
+        struct command *cmd = createCommandList(userInput);
+        traceEnd("parse", started, 0);
+        runLine(cmd);
+        arenaReset(&lineArena);
+    }
+    fflush(stdout);
+    return currStatus.lastStatus;
+}
+
+// Runs one parsed line, or sets the status for one that failed to parse.
+void runLine(struct command *cmd) {
+    // A line of only spaces has no commands in it.
+    if(cmd == NULL) {
+        currStatus.lastStatus = 1;
+    } else if(cmd->stages[0].argc > 0) {
+        long long started = traceStart();
+        runCommandList(cmd);
+        traceEnd("dispatch", started, 0);
+    }
+}
+
+// INPUT SOURCES
+/* Lines come from one of three places. At a terminal the : prompt is
+ * printed and flushed before each read. A script file, a regular file on
+ * stdin or a -c string is memory mapped and split in place, so a line
+ * costs a memchr and no copy or system call. Anything else on stdin, like
+ * a pipe, is read through a large stdio buffer with one reused line
+ * buffer. Shell output is only flushed before a child starts and on exit.
+ */
+// Maps a whole file privately so lines can be terminated in place.
+int mapFile(struct inputSource *source, int fd) {
+    struct stat info;
+
+    source->map = NULL;
+    source->length = 0;
+    source->position = 0;
+    source->line = NULL;
+    source->capacity = 0;
+    source->kind = INPUT_MAPPED;
+
+    if(fstat(fd, &info) == -1) return -1;
+    if(info.st_size == 0) return 0;
+
+    source->map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(source->map == MAP_FAILED) {
+        source->map = NULL;
+        return -1;
+    }
+    madvise(source->map, info.st_size, MADV_SEQUENTIAL);
+    source->length = info.st_size;
+    return 0;
+}
+
+int openScript(struct inputSource *source, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1 || mapFile(source, fd) == -1) {
+        fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+        if(fd != -1) close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+void openStandardInput(struct inputSource *source) {
+    struct stat info;
+
+    if(isatty(STDIN_FILENO)) {
+        char *terminal = getenv("TERM");
+        source->kind = INPUT_TERMINAL;
+        // The line editor needs a terminal that understands cursor movement.
+        source->edit = isatty(STDOUT_FILENO) && terminal != NULL && strcmp(terminal, "dumb") != 0;
+    } else if(fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode) && mapFile(source, STDIN_FILENO) == 0) {
+        return;
+    } else {
+        source->kind = INPUT_STREAM;
+        setvbuf(stdin, NULL, _IOFBF, 1 << 16);
+    }
+    source->map = NULL;
+    source->length = 0;
+    source->position = 0;
+    source->line = NULL;
+    source->capacity = 0;
+}
+
+void openCommandString(struct inputSource *source, const char *commands) {
+    source->kind = INPUT_STRING;
+    source->map = strdup(commands);
+    source->length = strlen(commands);
+    source->position = 0;
+    source->line = NULL;
+    source->capacity = 0;
+}
+
+/* Returns the next line of a mapped file or -c string, terminated in place.
+ * The last line of a file that ends exactly on a page boundary has no room
+ * for its terminator, so that one line is copied out instead.
+ */
+char *nextMappedLine(struct inputSource *source) {
+    if(source->position >= source->length) return NULL;
+
+    char *line = source->map + source->position;
+    size_t remaining = source->length - source->position;
+    char *end = memchr(line, '\n', remaining);
+
+    if(end != NULL) {
+        *end = '\0';
+        source->position += end - line + 1;
+        return line;
+    }
+
+    source->position = source->length;
+    if(source->kind == INPUT_STRING || source->length % sysconf(_SC_PAGESIZE) != 0) return line;
+
+    if(remaining + 1 > source->capacity) {
+        free(source->line);
+        source->capacity = remaining + 1;
+        source->line = malloc(source->capacity);
+    }
+    memcpy(source->line, line, remaining);
+    source->line[remaining] = '\0';
+    return source->line;
+}
+
+/* Gathers the user input as a solid string for parsing */
+char* getUserInput(struct inputSource *source){
+    /* 
+     * Get the line of user commands 
+     * returns the entire line as a
+     * string that stays valid until
+     * the next call
+     */
+
+    if(source->kind == INPUT_MAPPED || source->kind == INPUT_STRING) return nextMappedLine(source);
+    if(source->kind == INPUT_TERMINAL && source->edit) return editLine();
+
+    if(source->kind == INPUT_TERMINAL) {
+        printf(":");
+        fflush(stdout);
+        while(waitForInput());
+    }
+
+    ssize_t read = getline(&source->line, &source->capacity, stdin);
+    if(read == -1) return NULL;
+    if(read > 0 && source->line[read-1] == '\n') source->line[read-1] = '\0';
+
+    return source->line;
+}
+
+/* Verifies whether the initial value is a #
+ * denoting a comment, or a \0 which verifies
+ * a blank line
+ */
+int verifyUserInput(char userInput[]) {
+    /* 
+     * Verify the the user input is either 
+     * a blank line or a comment
+     */
+
+    if(userInput[0] == '\0' || userInput[0] == '#') return -1;
+    else return 1;
+}
+
+// SCRIPT CACHE
+/* A script file is compiled the first time it runs into a file in
+ * $SMALLSH_CACHE, or ~/.cache/smallsh, named after a hash of its full
+ * path. The header holds the path, size and mtime of the script, and the
+ * copy is only used while all three still match, so editing the script
+ * compiles it again. SMALLSH_CACHE set to an empty string turns it off.
+ *
+ * After the header every line that is not blank or a comment has a
+ * record. A record is a run of uint32_t codes followed by the strings
+ * they point at: for each command its connector, background flag and
+ * stage count, and for each stage its argc, < file, > file and argv.
+ * Words are stored as createCommandList() leaves them, with their quotes
+ * already removed, so loading a line means pointing argv into the mapped
+ * file. A word with a $ in it, $$ included, keeps its DEFERRED_WORD byte
+ * and is expanded when its command runs, as on any other line. A line
+ * that does not parse is stored as text and parsed when it is reached,
+ * which is where its error is printed.
+ */
+#define CACHE_MAGIC 0x63736d73
+#define CACHE_VERSION 2
+
+enum cachedKind { CACHED_TEXT = 0, CACHED_COMMANDS = 1 };
+
+struct cacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t length;            // of the whole cache file
+    uint64_t scriptSize;
+    int64_t mtimeSeconds;
+    int64_t mtimeNanoseconds;
+    uint32_t pathLength;        // the path follows, padded to 8 bytes
+    uint32_t unused;
+};
+
+struct cachedLine {
+    uint32_t size;              // to the next record, a multiple of 8
+    uint16_t kind;
+    uint16_t commandCount;
+};
+
+// Records are built in data and written out between lines.
+struct cacheWriter {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int fd;
+    size_t written;
+    int failed;
+};
+
+/* Swaps a mapped script for its compiled form, compiling it first if the
+ * cache has no current copy. The script runs from its text as before
+ * when the cache can't be used.
+ */
+void useScriptCache(struct inputSource *source, const char *path) {
+    char *setting = getenv("SMALLSH_CACHE");
+    char scriptPath[PATH_MAX], directory[PATH_MAX], cachePath[PATH_MAX + 16];
+    struct stat info;
+
+    if(source->map == NULL || (setting != NULL && *setting == '\0')) return;
+    if(realpath(path, scriptPath) == NULL || stat(scriptPath, &info) == -1) return;
+    if((size_t)info.st_size != source->length) return;
+
+    if(setting != NULL) {
+        snprintf(directory, sizeof(directory), "%s", setting);
+    } else if(getenv("XDG_CACHE_HOME") != NULL) {
+        snprintf(directory, sizeof(directory), "%s/smallsh", getenv("XDG_CACHE_HOME"));
+    } else if(getenv("HOME") != NULL) {
+        snprintf(directory, sizeof(directory), "%s/.cache", getenv("HOME"));
+        mkdir(directory, 0700);
+        snprintf(directory, sizeof(directory), "%s/.cache/smallsh", getenv("HOME"));
+    } else {
+        return;
+    }
+    mkdir(directory, 0700);
+    snprintf(cachePath, sizeof(cachePath), "%s/%08x.smc", directory, hashBytes(scriptPath, strlen(scriptPath)));
+
+    if(loadScriptCache(source, cachePath, scriptPath, &info) == 0) return;
+    if(compileScript(source, cachePath, scriptPath, &info) == 0) loadScriptCache(source, cachePath, scriptPath, &info);
+}
+
+// Maps the cache file in place of the script. Returns -1 if it is missing or stale.
+int loadScriptCache(struct inputSource *source, const char *cachePath, const char *scriptPath, struct stat *info) {
+    size_t pathLength = strlen(scriptPath);
+    struct stat cacheInfo;
+    int fd = open(cachePath, O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) return -1;
+    // Only a cache this user wrote and nobody else can change is trusted.
+    if(fstat(fd, &cacheInfo) == -1 || !S_ISREG(cacheInfo.st_mode) || cacheInfo.st_uid != getuid() ||
+       (cacheInfo.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+       (size_t)cacheInfo.st_size < sizeof(struct cacheHeader) + pathLength + 1) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, cacheInfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return -1;
+
+    struct cacheHeader *header = (struct cacheHeader *)map;
+    if(header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+       header->length != (uint64_t)cacheInfo.st_size || header->scriptSize != (uint64_t)info->st_size ||
+       header->mtimeSeconds != info->st_mtim.tv_sec || header->mtimeNanoseconds != info->st_mtim.tv_nsec ||
+       header->pathLength != pathLength || memcmp(header + 1, scriptPath, pathLength + 1) != 0) {
+        munmap(map, cacheInfo.st_size);
+        return -1;
+    }
+
+    // Every record is checked before the first line runs, so a damaged
+    // cache falls back to the script text instead of stopping halfway.
+    size_t start = sizeof(struct cacheHeader) + ((pathLength + 8) & ~(size_t)7);
+    for(size_t position = start; position < (size_t)cacheInfo.st_size;) {
+        struct cachedLine *record = (struct cachedLine *)(map + position);
+
+        if(!checkCachedLine(record, cacheInfo.st_size - position)) {
+            munmap(map, cacheInfo.st_size);
+            return -1;
+        }
+        position += record->size;
+    }
+
+    madvise(map, cacheInfo.st_size, MADV_SEQUENTIAL);
+    munmap(source->map, source->length);
+    source->map = map;
+    source->length = cacheInfo.st_size;
+    source->position = start;
+    source->kind = INPUT_CACHED;
+    return 0;
+}
+
+/* Compiles every line of the mapped script and writes the result under a
+ * temporary name that is then renamed, so a shell starting at the same
+ * time never maps half a file. Returns -1 if it could not be written.
+ */
+int compileScript(struct inputSource *source, const char *cachePath, const char *scriptPath, struct stat *info) {
+    static const char padding[8];
+    struct cacheWriter writer = {NULL, 0, 0, -1, 0, 0};
+    struct cacheHeader header;
+    char temporary[PATH_MAX + 32];
+    size_t position = 0;
+
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", cachePath);
+    writer.fd = mkostemp(temporary, O_CLOEXEC);
+    if(writer.fd == -1) return -1;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.scriptSize = info->st_size;
+    header.mtimeSeconds = info->st_mtim.tv_sec;
+    header.mtimeNanoseconds = info->st_mtim.tv_nsec;
+    header.pathLength = strlen(scriptPath);
+    appendCache(&writer, &header, sizeof(header));
+    appendCache(&writer, scriptPath, header.pathLength + 1);
+    appendCache(&writer, padding, -writer.length & 7);
+
+    // Syntax errors are printed when their line is run, not now.
+    int savedError = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    int nullFD = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    dup2(nullFD, STDERR_FILENO);
+
+    while(position < source->length) {
+        char *line = source->map + position;
+        char *end = memchr(line, '\n', source->length - position);
+        size_t length = end != NULL ? (size_t)(end - line) : source->length - position;
+        char *text = arenaAlloc(&lineArena, length + 1);
+
+        memcpy(text, line, length);
+        text[length] = '\0';
+        position += length + 1;
+        if(verifyUserInput(text) != -1) compileLine(&writer, text);
+        arenaReset(&lineArena);
+        if(writer.length >= 65536) flushCache(&writer);
+    }
+
+    dup2(savedError, STDERR_FILENO);
+    close(savedError);
+    if(nullFD != -1) close(nullFD);
+
+    flushCache(&writer);
+    header.length = writer.written;
+    if(pwrite(writer.fd, &header.length, sizeof(header.length), offsetof(struct cacheHeader, length)) != sizeof(header.length)) writer.failed = 1;
+    close(writer.fd);
+    free(writer.data);
+    if(writer.failed || rename(temporary, cachePath) == -1) {
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+// Adds the record for one line.
+void compileLine(struct cacheWriter *writer, char *line) {
+    static const char padding[8];
+    struct cachedLine record = {0, CACHED_TEXT, 0};
+    size_t start = writer->length;
+    struct command *cmd;
+    int codes = 0, commands = 0, tooLarge = 0;
+
+    compilingScript = 1;
+    cmd = createCommandList(line);
+    compilingScript = 0;
+    for(struct command *part = cmd; part != NULL; part = part->next) {
+        commands++;
+        codes++;
+        if(part->stageCount > 0xffff) tooLarge = 1;
+        for(int i = 0; i < part->stageCount; i++) codes += 3 + part->stages[i].argc;
+    }
+
+    if(cmd == NULL || commands > 0xffff || tooLarge) {
+        appendCache(writer, &record, sizeof(record));
+        appendCache(writer, line, strlen(line) + 1);
+    } else {
+        // Strings are numbered from the start of the record, after the codes.
+        uint32_t offset = sizeof(record) + codes * sizeof(uint32_t);
+
+        record.kind = CACHED_COMMANDS;
+        record.commandCount = commands;
+        appendCache(writer, &record, sizeof(record));
+        for(struct command *part = cmd; part != NULL; part = part->next) {
+            uint32_t code = part->connector | part->background << 8 | part->stageCount << 16;
+
+            appendCache(writer, &code, sizeof(code));
+            for(int i = 0; i < part->stageCount; i++) {
+                struct stage *stage = &part->stages[i];
+                uint32_t stageCodes[3] = {stage->argc, cacheReference(stage->input, &offset), cacheReference(stage->output, &offset)};
+
+                appendCache(writer, stageCodes, sizeof(stageCodes));
+                for(int j = 0; j < stage->argc; j++) {
+                    code = cacheReference(stage->argv[j], &offset);
+                    appendCache(writer, &code, sizeof(code));
+                }
+            }
+        }
+        // The strings in the same order as their references.
+        for(struct command *part = cmd; part != NULL; part = part->next) {
+            for(int i = 0; i < part->stageCount; i++) {
+                struct stage *stage = &part->stages[i];
+                char *words[2] = {stage->input, stage->output};
+
+                for(int j = 0; j < 2 + stage->argc; j++) {
+                    char *word = j < 2 ? words[j] : stage->argv[j - 2];
+                    if(word == NULL) continue;
+                    appendCache(writer, word, strlen(word) + 1);
+                }
+            }
+        }
+    }
+    appendCache(writer, padding, -writer->length & 7);
+    ((struct cachedLine *)(writer->data + start))->size = writer->length - start;
+}
+
+void appendCache(struct cacheWriter *writer, const void *data, size_t length) {
+    if(writer->length + length > writer->capacity) {
+        while(writer->length + length > writer->capacity) writer->capacity = writer->capacity == 0 ? 65536 : writer->capacity * 2;
+        writer->data = realloc(writer->data, writer->capacity);
+    }
+    memcpy(writer->data + writer->length, data, length);
+    writer->length += length;
+}
+
+// Writes out the finished records. Records are padded to 8 bytes, so the next starts aligned.
+void flushCache(struct cacheWriter *writer) {
+    if(!writer->failed && write(writer->fd, writer->data, writer->length) != (ssize_t)writer->length) writer->failed = 1;
+    writer->written += writer->length;
+    writer->length = 0;
+}
+
+// Returns the code for word, whose string will be written at *offset, or 0 for none.
+uint32_t cacheReference(const char *word, uint32_t *offset) {
+    uint32_t reference = *offset;
+
+    if(word == NULL) return 0;
+    *offset += strlen(word) + 1;
+    return reference;
+}
+
+/* Whether a record fits in the room left in the cache and every code and
+ * string reference in it stays inside the record. Strings must start after
+ * the codes, and the record has to end in a NUL, so none can run past it.
+ */
+int checkCachedLine(struct cachedLine *record, size_t room) {
+    char *base = (char *)record;
+    uint32_t *code = (uint32_t *)(record + 1), *end;
+    uint32_t strings;
+
+    if(room < sizeof(*record) || record->size <= sizeof(*record) || record->size % 8 != 0 ||
+       record->size > room || base[record->size - 1] != '\0') {
+        return 0;
+    }
+    if(record->kind == CACHED_TEXT) return 1;
+    if(record->kind != CACHED_COMMANDS || record->commandCount == 0) return 0;
+    end = (uint32_t *)(base + record->size);
+
+    // Walk the codes once to find where the strings start.
+    for(int i = 0; i < record->commandCount; i++) {
+        if(code >= end || (*code & 0xff) > LIST_OR || (*code >> 8 & 0xff) > 1 || *code >> 16 == 0) return 0;
+        for(uint32_t j = 0, stageCount = *code++ >> 16; j < stageCount; j++) {
+            if(end - code < 3 || code[0] > (uint32_t)(end - code - 3)) return 0;
+            code += 3 + code[0];
+        }
+    }
+    strings = (char *)code - base;
+
+    // Then check every reference against that.
+    code = (uint32_t *)(record + 1);
+    for(int i = 0; i < record->commandCount; i++) {
+        for(uint32_t j = 0, stageCount = *code++ >> 16; j < stageCount; j++) {
+            uint32_t argc = code[0];
+
+            for(uint32_t k = 1; k < 3 + argc; k++) {
+                if(k < 3 && code[k] == 0) continue;
+                if(code[k] < strings || code[k] >= record->size) return 0;
+            }
+            code += 3 + argc;
+        }
+    }
+    return 1;
+}
+
+/* Builds the commands of the next record in the arena, as
+ * createCommandList() would have from its line. loadScriptCache() has
+ * checked every record already.
+ */
+struct command *nextCachedLine(struct inputSource *source) {
+    struct cachedLine *record = (struct cachedLine *)(source->map + source->position);
+    char *base = (char *)record;
+    uint32_t *code = (uint32_t *)(record + 1);
+    struct command *first = NULL, *last = NULL;
+
+    source->position += record->size;
+    if(record->kind == CACHED_TEXT) return createCommandList(base + sizeof(struct cachedLine));
+
+    for(int i = 0; i < record->commandCount; i++) {
+        struct command *cmd = newCommand(*code & 0xff);
+        int stageCount = *code >> 16;
+
+        cmd->background = *code >> 8 & 0xff;
+        code++;
+        for(int j = 0; j < stageCount; j++) {
+            struct stage *stage = j == 0 ? &cmd->stages[0] : addStage(cmd);
+            uint32_t argc = code[0], input = code[1], output = code[2];
+
+            code += 3;
+            for(uint32_t k = 0; k < argc; k++) addArgument(stage, base + *code++);
+            if(input != 0) stage->input = base + input;
+            if(output != 0) stage->output = base + output;
+        }
+        if(first == NULL) first = cmd;
+        else last->next = cmd;
+        last = cmd;
+    }
+    return first;
+}
+
+// Commands that activateCommands() runs itself, besides the builtins table.
+static const char *shellCommands[] = {"exit", "cd", "status", "launch", "hash", "jobs", "wait", "queue", "ulimit",
+                                      "export", "unset", "history", "parallel", "time", "limit", "sched"};
+
+int isShellCommand(const char *name) {
+    for(size_t i = 0; i < sizeof(shellCommands) / sizeof(shellCommands[0]); i++) {
+        if(strcmp(shellCommands[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Runs the commands of a line in order, expanding the words of each just
+ * before it runs. A command after && only runs if the status left by the
+ * one before is 0, and after || only if it is not, so a skipped command
+ * passes the status on. An and-or list that ends in & is run by a fork of
+ * the shell as one background job, since each part has to wait for the
+ * one before it.
+ */
+void runCommandList(struct command *cmd) {
+    while(cmd != NULL) {
+        struct command *last = cmd;
+
+        // The and-or list starting at cmd ends at the next ; or &.
+        while(last->next != NULL && last->next->connector != LIST_ALWAYS) last = last->next;
+
+        if(last != cmd && last->background && currStatus.foregroundOnlyMode == 0) {
+            cmd->listEnd = last;
+            if(queueIsFull()) queueJob(cmd);
+            else startBackgroundList(cmd);
+            cmd = last->next;
+            continue;
+        }
+        while(1) {
+            int skip = (cmd->connector == LIST_AND && currStatus.lastStatus != 0) ||
+                       (cmd->connector == LIST_OR && currStatus.lastStatus == 0);
+
+            // A skipped command's $( ) never runs.
+            if(!skip && expandCommand(cmd) == -1) currStatus.lastStatus = 1;
+            else if(!skip && cmd->stages[0].argc > 0) activateCommands(cmd);
+            if(cmd == last) break;
+            cmd = cmd->next;
+        }
+        cmd = last->next;
+    }
+}
+
+/* Starts the list from cmd to cmd->listEnd as a background job. The fork
+ * runs it in the foreground of its own, without the terminal, and exits
+ * with the status of the last command it ran.
+ */
+void startBackgroundList(struct command *cmd) {
+    struct command *last = cmd->listEnd;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0) {
+        forgetTrace();
+        currStatus.forked = 1;
+        last->next = NULL;
+        last->background = 0;
+        cmd->listEnd = NULL;
+        currStatus.interactive = 0;
+        currStatus.backgroundList = 1;
+        runCommandList(cmd);
+        fflush(stdout);
+        _exit(currStatus.lastStatus);
+    }
+    if(pid == -1) {
+        perror("fork()");
+        currStatus.lastStatus = 1;
+        return;
+    }
+    startBackgroundJob(cmd, &pid, 1);
+}
+
+/* Activate commands handles both the built in processes and routes
+ * the executable processes.
+ */
+void activateCommands(struct command *cmd) {
+    /* Examines the first word of the command
+       if the first word is one of the built in
+       commands, it will perform the built in action
+       other commands will be sent to be parsed by 
+       the execution functions */
+
+    struct stage *first = &cmd->stages[0];
+    char *name = first->argv[0];
+    int single = cmd->stageCount == 1;
+    int assignments = 0;
+
+    while(single && assignments < first->argc && isAssignment(first->argv[assignments]) > 0) assignments++;
+    if(assignments > 0) {
+        runWithAssignments(cmd, assignments);
+        return;
+    }
+
+    if(strcmp(name, "time") == 0) {
+        timeCommand(cmd);
+        return;
+    }
+    if(single && strcmp(name, "limit") == 0) {
+        limitCommand(cmd);
+        return;
+    }
+    if(single && strcmp(name, "sched") == 0) {
+        schedCommand(cmd);
+        return;
+    }
+    startUsage(&currStatus.commandUsage);
+
+    if(single && strcmp(name, "exit") == 0) {
+        fflush(stdout);
+        if(currStatus.forked) _exit(0);
+        exit(0);
+    } else if (single && strcmp(name, "cd") == 0){
+        changeDirectory(first);
+    } else if(single && strcmp(name, "status") == 0){
+        getStatus();
+    } else if(single && strcmp(name, "launch") == 0){
+        launchCommand(first);
+    } else if(single && strcmp(name, "hash") == 0){
+        hashCommand(first);
+    } else if(single && strcmp(name, "jobs") == 0){
+        listJobs();
+    } else if(single && strcmp(name, "wait") == 0){
+        waitCommand(first);
+    } else if(single && strcmp(name, "queue") == 0){
+        queueCommand(first);
+    } else if(single && strcmp(name, "ulimit") == 0){
+        ulimitCommand(first);
+    } else if(single && strcmp(name, "export") == 0){
+        exportCommand(first);
+    } else if(single && strcmp(name, "unset") == 0){
+        unsetCommand(first);
+    } else if(single && strcmp(name, "history") == 0){
+        historyCommand(first);
+    } else if(single && strcmp(name, "parallel") == 0){
+        parallelCommand(first);
+    } else {
+        // The lexer already found any &, < or > and | in the line
+        int checkBackground = cmd->background;
+
+        // Follows a global variable
+        if(currStatus.foregroundOnlyMode == 1) {
+            checkBackground = 0;
+        }
+
+        struct builtin *builtin;
+
+        if(checkBackground == 1 && queueIsFull()) {
+            queueJob(cmd);
+        } else if(single && checkBackground == 0 && currStatus.limits == NULL && currStatus.placement == NULL &&
+                  (builtin = findBuiltin(name)) != NULL) {
+            runBuiltin(first, builtin);
+        } else {
+            dispatchJob(cmd, checkBackground);
+        }
+    }
+
+    if(currStatus.commandUsage.processes > 0) recordUsage(&currStatus.commandUsage, describeCommand(cmd));
+}
+
+/* time command runs the rest of the line and prints what it cost on
+ * stderr. A builtin has no child to measure, so the shell's own usage
+ * over the command is shown instead.
+ */
+void timeCommand(struct command *cmd) {
+    struct stage *first = &cmd->stages[0];
+    long usageCount = currStatus.usageCount;
+    struct jobUsage usage;
+    struct rusage before, after;
+
+    if(first->argc == 1) {
+        fprintf(stderr, "usage: time command\n");
+        currStatus.lastStatus = 1;
+        return;
+    }
+
+    startUsage(&usage);
+    getrusage(RUSAGE_SELF, &before);
+    first->argv++;
+    first->argc--;
+    activateCommands(cmd);
+
+    if(currStatus.usageCount != usageCount) {
+        printUsage(stderr, &currStatus.lastUsage);
+        return;
+    }
+    getrusage(RUSAGE_SELF, &after);
+    usage.wallNs = nowNs() - usage.startNs;
+    timersub(&after.ru_utime, &before.ru_utime, &usage.rusage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &usage.rusage.ru_stime);
+    usage.rusage.ru_maxrss = after.ru_maxrss;
+    usage.rusage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    usage.rusage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    printUsage(stderr, &usage);
+}
+
+// HISTORY
+/* Lines typed at the prompt are kept in a ring file, $SMALLSH_HISTORY or
+ * ~/.smallsh_history, of HISTORY_SLOTS fixed size slots after a header.
+ * The file is mapped shared, so starting the shell reads nothing and
+ * adding a line is a memcpy into the map. Once the ring is full the
+ * oldest lines are overwritten.
+ *
+ * Every shell using the file appends to the same ring. A line takes its
+ * number from an atomic counter in the header, which also picks its slot,
+ * so two shells never write the same slot. A slot holds the number of its
+ * line, set to 0 while the text is written and to the number again after.
+ * A reader copies the text and checks that number before and after, and
+ * skips a slot that was being rewritten. Lines too long for a slot are not
+ * kept. SMALLSH_HISTORY set to an empty string turns history off.
+ */
+#define HISTORY_MAGIC 0x68736d73
+#define HISTORY_SLOTS 4096
+#define HISTORY_SLOT_SIZE 512
+
+struct historySlot {
+    uint64_t number;
+    uint32_t length;
+    char text[HISTORY_SLOT_SIZE - 12];
+};
+
+struct historyHeader {
+    uint32_t magic;
+    uint32_t slotCount;
+    uint32_t slotSize;
+    uint32_t unused;
+    uint64_t next;
+    char padding[HISTORY_SLOT_SIZE - 24];
+};
+
+struct history {
+    int opened;
+    struct historyHeader *header;
+    struct historySlot *slots;
+};
+
+static struct history history = {0, NULL, NULL};
+
+// Maps the history file on first use. Returns 0, or -1 when there is none.
+int openHistory() {
+    size_t size = sizeof(struct historyHeader) + HISTORY_SLOTS * sizeof(struct historySlot);
+    char defaultPath[PATH_MAX];
+    struct stat info;
+
+    if(history.opened) return history.header == NULL ? -1 : 0;
+    history.opened = 1;
+
+    char *path = getenv("SMALLSH_HISTORY");
+    if(path == NULL) {
+        if(getenv("HOME") == NULL) return -1;
+        snprintf(defaultPath, sizeof(defaultPath), "%s/.smallsh_history", getenv("HOME"));
+        path = defaultPath;
+    }
+    if(*path == '\0') return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1) return -1;
+
+    // A new file is sized and given its header by whichever shell gets here first.
+    flock(fd, LOCK_EX);
+    if(fstat(fd, &info) == 0 && info.st_size == 0 && ftruncate(fd, size) == 0) info.st_size = size;
+    if(info.st_size != (off_t)size) {
+        fprintf(stderr, "smallsh: %s is not a history file, history is off\n", path);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map != MAP_FAILED) {
+        history.header = map;
+        history.slots = (struct historySlot *)(history.header + 1);
+        if(history.header->magic != HISTORY_MAGIC) {
+            history.header->slotCount = HISTORY_SLOTS;
+            history.header->slotSize = HISTORY_SLOT_SIZE;
+            history.header->magic = HISTORY_MAGIC;
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return history.header == NULL ? -1 : 0;
+}
+
+void addHistory(const char *line) {
+    size_t length = strlen(line);
+
+    if(openHistory() == -1 || length >= sizeof(history.slots->text)) return;
+
+    uint64_t number = __atomic_fetch_add(&history.header->next, 1, __ATOMIC_ACQ_REL) + 1;
+    struct historySlot *slot = &history.slots[(number - 1) % HISTORY_SLOTS];
+
+    __atomic_store_n(&slot->number, 0, __ATOMIC_RELEASE);
+    memcpy(slot->text, line, length);
+    slot->length = length;
+    __atomic_store_n(&slot->number, number, __ATOMIC_RELEASE);
+}
+
+// Copies line number into out. Returns -1 if it is gone or being rewritten.
+int getHistory(uint64_t number, char *out) {
+    if(openHistory() == -1 || number == 0) return -1;
+
+    struct historySlot *slot = &history.slots[(number - 1) % HISTORY_SLOTS];
+    if(__atomic_load_n(&slot->number, __ATOMIC_ACQUIRE) != number) return -1;
+
+    uint32_t length = slot->length;
+    if(length >= sizeof(slot->text)) return -1;
+    memcpy(out, slot->text, length);
+    out[length] = '\0';
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->number, __ATOMIC_RELAXED) == number ? 0 : -1;
+}
+
+// Numbers of the newest line and the oldest one still in the ring.
+uint64_t lastHistory() {
+    return openHistory() == -1 ? 0 : __atomic_load_n(&history.header->next, __ATOMIC_ACQUIRE);
+}
+
+uint64_t firstHistory() {
+    uint64_t last = lastHistory();
+    return last > HISTORY_SLOTS ? last - HISTORY_SLOTS + 1 : 1;
+}
+
+/* Returns the newest line numbered below before that starts with text, or
+ * contains it when prefixOnly is 0, copying it into out. Returns 0 if there
+ * is none. Calling it again with the number it returned finds the next
+ * older match, which is how an incremental search steps back.
+ */
+uint64_t searchHistory(const char *text, uint64_t before, int prefixOnly, char *out) {
+    uint64_t first = firstHistory();
+    size_t length = strlen(text);
+
+    for(uint64_t number = before - 1; number >= first && number > 0; number--) {
+        if(getHistory(number, out) == -1) continue;
+        if(prefixOnly ? strncmp(out, text, length) == 0 : strstr(out, text) != NULL) return number;
+    }
+    return 0;
+}
+
+/* Replaces a leading !! (the last line), !n (line n), !-n (n lines back) or
+ * !prefix (the newest line starting with prefix) with the line it names.
+ * The rest of the line is kept, so !! | wc works. The new line is echoed
+ * like in other shells. Returns NULL after an error.
+ */
+char *expandHistory(char *line) {
+    if(line[0] != '!' || line[1] == '\0' || line[1] == ' ' || line[1] == '=') return line;
+
+    char *rest = line + 1;
+    while(*rest != '\0' && *rest != ' ' && *rest != '\t') rest++;
+
+    char *event = arenaAlloc(&lineArena, rest - line);
+    memcpy(event, line + 1, rest - line - 1);
+    event[rest - line - 1] = '\0';
+
+    char *found = arenaAlloc(&lineArena, sizeof(history.slots->text) + strlen(rest));
+    uint64_t last = lastHistory();
+    uint64_t number = 0;
+    char *end;
+
+    if(strcmp(event, "!") == 0) {
+        number = last;
+    } else if((event[0] == '-' || (event[0] >= '0' && event[0] <= '9')) && strtoll(event, &end, 10) != 0 && *end == '\0') {
+        long long index = strtoll(event, NULL, 10);
+        number = index < 0 ? (uint64_t)(last + 1 + index) : (uint64_t)index;
+        if(index < 0 && (uint64_t)-index > last) number = 0;
+    } else {
+        number = searchHistory(event, last + 1, 1, found);
+    }
+
+    if(number == 0 || number > last || getHistory(number, found) == -1) {
+        fprintf(stderr, "smallsh: !%s: event not found\n", event);
+        return NULL;
+    }
+    strcat(found, rest);
+    printf("%s\n", found);
+    return found;
+}
+
+/* history          -> every line still in the ring
+ * history n        -> the last n lines
+ * history -s text  -> lines containing text, newest first
+ */
+void historyCommand(struct stage *stage) {
+    char *line = arenaAlloc(&lineArena, sizeof(history.slots->text));
+    uint64_t last = lastHistory();
+    uint64_t first = firstHistory();
+
+    currStatus.lastStatus = 0;
+    if(stage->argc == 3 && strcmp(stage->argv[1], "-s") == 0) {
+        for(uint64_t number = searchHistory(stage->argv[2], last + 1, 0, line); number != 0;
+            number = searchHistory(stage->argv[2], number, 0, line)) {
+            printf("%5llu  %s\n", (unsigned long long)number, line);
+        }
+        return;
+    }
+    if(stage->argc == 2) {
+        long count = atol(stage->argv[1]);
+        if(count <= 0) {
+            fprintf(stderr, "usage: history [count | -s text]\n");
+            currStatus.lastStatus = 1;
+            return;
+        }
+        if(last > (uint64_t)count && last - count + 1 > first) first = last - count + 1;
+    }
+    for(uint64_t number = first; number <= last; number++) {
+        if(getHistory(number, line) == 0) printf("%5llu  %s\n", (unsigned long long)number, line);
+    }
+}
+
+// LINE EDITOR
+/* At a terminal lines are read by a small editor with the terminal in raw
+ * mode, and the terminal is put back before the line runs. It keeps
+ * ctrl-z working, redraws the line when a background job is reported, and
+ * knows these keys:
+ *   left/right ^B ^F, home/end ^A ^E  move      backspace ^H, delete ^D
+ *   ^U ^K ^W  delete to start, to end, a word    up/down ^P ^N  history
+ *   ^R  incremental history search              tab  complete
+ *   ^L  clear the screen                          ^D on an empty line ends
+ */
+struct editor {
+    char *line;
+    size_t length;
+    size_t cursor;
+    size_t capacity;
+    int tabs;
+    uint64_t historyNumber;
+    char *typed;
+};
+
+static struct editor editor = {NULL, 0, 0, 0, 0, 0, NULL};
+
+char *editLine() {
+    struct termios saved, raw;
+    char *result = NULL;
+
+    if(editor.capacity == 0) {
+        editor.capacity = 256;
+        editor.line = malloc(editor.capacity);
+    }
+    editor.length = editor.cursor = 0;
+    editor.line[0] = '\0';
+    editor.tabs = 0;
+    editor.historyNumber = lastHistory() + 1;
+
+    tcgetattr(STDIN_FILENO, &saved);
+    raw = saved;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    printf(":");
+    fflush(stdout);
+    while(1) {
+        unsigned char key, sequence[3];
+
+        while(waitForInput()) refreshLine();
+        ssize_t bytes = read(STDIN_FILENO, &key, 1);
+        if(bytes == -1 && errno == EINTR) continue;
+        if(bytes <= 0) break;
+        if(key != '\t') editor.tabs = 0;
+
+        if(key == '\r' || key == '\n') {
+            result = editor.line;
+            break;
+        } else if(key == 4 && editor.length == 0) {
+            break;
+        } else if(key == 4) {
+            deleteText(editor.cursor, editor.cursor + 1);
+        } else if(key == 127 || key == 8) {
+            if(editor.cursor > 0) deleteText(editor.cursor - 1, editor.cursor);
+        } else if(key == 1) {
+            editor.cursor = 0;
+        } else if(key == 5) {
+            editor.cursor = editor.length;
+        } else if(key == 2) {
+            if(editor.cursor > 0) editor.cursor--;
+        } else if(key == 6) {
+            if(editor.cursor < editor.length) editor.cursor++;
+        } else if(key == 11) {
+            deleteText(editor.cursor, editor.length);
+        } else if(key == 21) {
+            deleteText(0, editor.cursor);
+        } else if(key == 23) {
+            size_t start = editor.cursor;
+            while(start > 0 && editor.line[start - 1] == ' ') start--;
+            while(start > 0 && editor.line[start - 1] != ' ') start--;
+            deleteText(start, editor.cursor);
+        } else if(key == 12) {
+            printf("\033[H\033[2J");
+        } else if(key == 16 || key == 14) {
+            recallHistory(key == 16 ? -1 : 1);
+        } else if(key == 18) {
+            if(reverseSearch()) {
+                result = editor.line;
+                break;
+            }
+        } else if(key == '\t') {
+            editor.tabs++;
+            completeWord();
+        } else if(key == 27) {
+            // Arrow, home, end and delete keys arrive as ESC [ x or ESC O x.
+            if(read(STDIN_FILENO, sequence, 2) != 2) continue;
+            if(sequence[1] >= '0' && sequence[1] <= '9') {
+                if(read(STDIN_FILENO, sequence + 2, 1) != 1) continue;
+                if(sequence[1] == '1' || sequence[1] == '7') editor.cursor = 0;
+                if(sequence[1] == '4' || sequence[1] == '8') editor.cursor = editor.length;
+                if(sequence[1] == '3') deleteText(editor.cursor, editor.cursor + 1);
+            } else if(sequence[1] == 'A' || sequence[1] == 'B') {
+                recallHistory(sequence[1] == 'A' ? -1 : 1);
+            } else if(sequence[1] == 'C') {
+                if(editor.cursor < editor.length) editor.cursor++;
+            } else if(sequence[1] == 'D') {
+                if(editor.cursor > 0) editor.cursor--;
+            } else if(sequence[1] == 'H') {
+                editor.cursor = 0;
+            } else if(sequence[1] == 'F') {
+                editor.cursor = editor.length;
+            }
+        } else if(key >= 32) {
+            insertText((char *)&key, 1);
+        }
+        refreshLine();
+    }
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    printf("\n");
+    free(editor.typed);
+    editor.typed = NULL;
+    return result;
+}
+
+// Redraws the prompt and line and puts the cursor back in place.
+void refreshLine() {
+    printf("\r:%s\033[K\r\033[%zuC", editor.line, editor.cursor + 1);
+    fflush(stdout);
+}
+
+void insertText(const char *text, size_t length) {
+    if(editor.length + length + 1 > editor.capacity) {
+        while(editor.length + length + 1 > editor.capacity) editor.capacity *= 2;
+        editor.line = realloc(editor.line, editor.capacity);
+    }
+    memmove(editor.line + editor.cursor + length, editor.line + editor.cursor, editor.length - editor.cursor + 1);
+    memcpy(editor.line + editor.cursor, text, length);
+    editor.length += length;
+    editor.cursor += length;
+}
+
+void deleteText(size_t from, size_t to) {
+    if(to > editor.length) to = editor.length;
+    if(from >= to) return;
+    memmove(editor.line + from, editor.line + to, editor.length - to + 1);
+    editor.length -= to - from;
+    editor.cursor = from;
+}
+
+// Steps to an older (-1) or newer (1) history line, keeping what was typed.
+void recallHistory(int direction) {
+    char text[HISTORY_SLOT_SIZE];
+    uint64_t last = lastHistory();
+    uint64_t number = editor.historyNumber;
+
+    if(direction < 0) {
+        for(number--; number >= firstHistory() && number > 0; number--) {
+            if(getHistory(number, text) == 0) break;
+        }
+        if(number == 0 || number < firstHistory()) return;
+        if(editor.historyNumber > last) editor.typed = strdup(editor.line);
+    } else {
+        if(number > last) return;
+        for(number++; number <= last; number++) {
+            if(getHistory(number, text) == 0) break;
+        }
+        if(number > last) {
+            snprintf(text, sizeof(text), "%s", editor.typed != NULL ? editor.typed : "");
+            free(editor.typed);
+            editor.typed = NULL;
+        }
+    }
+
+    editor.historyNumber = number;
+    editor.length = editor.cursor = 0;
+    editor.line[0] = '\0';
+    insertText(text, strlen(text));
+}
+
+/* ^R searches back through history for lines containing what is typed
+ * after it, each further ^R finding the next older match. Enter runs the
+ * match, ^G or escape leaves the line as it was, and any other key keeps
+ * the match for editing. Returns 1 if the line should run.
+ */
+int reverseSearch() {
+    char query[128] = "";
+    char match[HISTORY_SLOT_SIZE] = "";
+    size_t length = 0;
+    uint64_t number = 0;
+    unsigned char key;
+
+    while(1) {
+        printf("\r(search)'%s': %s\033[K", query, match);
+        fflush(stdout);
+        if(read(STDIN_FILENO, &key, 1) != 1) return 0;
+
+        if(key == '\r' || key == '\n' || (key < 32 && key != 18 && key != 8) || key == 127) {
+            if(key == 127 || key == 8) {
+                if(length > 0) query[--length] = '\0';
+                number = length > 0 ? searchHistory(query, lastHistory() + 1, 0, match) : 0;
+                if(number == 0) match[0] = '\0';
+                continue;
+            }
+            if(key != 7 && key != 27 && number != 0) {
+                editor.length = editor.cursor = 0;
+                editor.line[0] = '\0';
+                insertText(match, strlen(match));
+            }
+            return (key == '\r' || key == '\n') && number != 0;
+        }
+        if(key == 18) {
+            uint64_t older = searchHistory(query, number != 0 ? number : lastHistory() + 1, 0, match);
+            if(older != 0) number = older;
+            else if(number != 0) getHistory(number, match);
+            continue;
+        }
+        if(length + 1 < sizeof(query)) {
+            query[length++] = key;
+            query[length] = '\0';
+        }
+        number = searchHistory(query, lastHistory() + 1, 0, match);
+        if(number == 0) match[0] = '\0';
+    }
+}
+
+// COMMAND COMPLETION
+/* Tab completes the word before the cursor. The first word of a command
+ * completes to builtins and executables on PATH, any other word, or a word
+ * containing a /, to file names. One match is filled in, several are
+ * filled in as far as they agree, and a second tab lists them.
+ *
+ * Executables are kept in a prefix trie built the first time it is needed.
+ * Each PATH directory remembers its mtime and the names it added, and on
+ * later tabs only directories whose mtime changed are read again, their old
+ * names taken out of the trie and the new ones put in. A name found in more
+ * than one directory is counted once per directory, so it stays until the
+ * last one drops it. Nodes left with no names under them are kept, they are
+ * simply never listed.
+ */
+struct matchList {
+    char **items;
+    int count;
+    int capacity;
+};
+
+struct trieNode {
+    int child;
+    int sibling;
+    int count;
+    char letter;
+};
+
+struct pathDirectory {
+    char *path;
+    struct timespec mtime;
+    char *names;
+    size_t namesLength;
+    int inPath;
+};
+
+struct commandTrie {
+    struct trieNode *nodes;
+    int nodeCount;
+    int nodeCapacity;
+    struct pathDirectory *directories;
+    int directoryCount;
+    char *pathValue;
+};
+
+static struct commandTrie commandTrie = {NULL, 0, 0, NULL, 0, NULL};
+
+void completeWord() {
+    struct matchList matches = {NULL, 0, 0};
+    size_t start = editor.cursor;
+
+    while(start > 0 && strchr(" \t|<>", editor.line[start - 1]) == NULL) start--;
+    size_t before = start;
+    while(before > 0 && editor.line[before - 1] == ' ') before--;
+    int commandWord = before == 0 || editor.line[before - 1] == '|';
+
+    char *word = strndup(editor.line + start, editor.cursor - start);
+    size_t wordLength = strlen(word);
+
+    if(commandWord && strchr(word, '/') == NULL) {
+        updateCommandTrie();
+        char name[NAME_MAX + 1];
+        int node = 0;
+        for(size_t i = 0; i < wordLength && node != -1; i++) node = trieChild(node, word[i], 0);
+        if(node != -1 && wordLength <= NAME_MAX) {
+            memcpy(name, word, wordLength);
+            trieCollect(node, name, wordLength, &matches);
+        }
+    } else {
+        completePath(word, &matches);
+    }
+
+    if(matches.count == 0) {
+        printf("\a");
+    } else {
+        // Fill in as much as all the matches agree on.
+        size_t common = strlen(matches.items[0]);
+        for(int i = 1; i < matches.count; i++) {
+            size_t same = 0;
+            while(same < common && matches.items[i][same] == matches.items[0][same]) same++;
+            common = same;
+        }
+        if(common > wordLength) insertText(matches.items[0] + wordLength, common - wordLength);
+        if(matches.count == 1 && matches.items[0][common - 1] != '/') insertText(" ", 1);
+        if(matches.count > 1 && common == wordLength && editor.tabs > 1) {
+            char *slash = strrchr(word, '/');
+            listMatches(&matches, slash == NULL ? 0 : slash - word + 1);
+        } else if(matches.count > 1 && common == wordLength) {
+            printf("\a");
+        }
+    }
+
+    for(int i = 0; i < matches.count; i++) free(matches.items[i]);
+    free(matches.items);
+    free(word);
+}
+
+void addMatch(struct matchList *matches, const char *text) {
+    if(matches->count == matches->capacity) {
+        matches->capacity = matches->capacity == 0 ? 32 : matches->capacity * 2;
+        matches->items = realloc(matches->items, matches->capacity * sizeof(char *));
+    }
+    matches->items[matches->count++] = strdup(text);
+}
+
+int compareMatches(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Prints the matches in columns under the line, without the directory part.
+void listMatches(struct matchList *matches, size_t skip) {
+    struct winsize window;
+    size_t width = 0;
+    int shown = matches->count > 200 ? 200 : matches->count;
+
+    qsort(matches->items, matches->count, sizeof(char *), compareMatches);
+    for(int i = 0; i < shown; i++) {
+        size_t length = strlen(matches->items[i] + skip);
+        if(length > width) width = length;
+    }
+    width += 2;
+
+    int columns = 1;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > width) columns = window.ws_col / width;
+
+    printf("\r\n");
+    for(int i = 0; i < shown; i++) {
+        printf("%-*s", (int)width, matches->items[i] + skip);
+        if((i + 1) % columns == 0 || i == shown - 1) printf("\r\n");
+    }
+    if(shown < matches->count) printf("... and %d more\r\n", matches->count - shown);
+}
+
+// Files whose names start with the part of word after its last /.
+void completePath(const char *word, struct matchList *matches) {
+    const char *slash = strrchr(word, '/');
+    size_t directoryLength = slash == NULL ? 0 : slash - word + 1;
+    const char *prefix = word + directoryLength;
+    size_t prefixLength = strlen(prefix);
+    char directory[PATH_MAX];
+    char candidate[PATH_MAX];
+    struct dirent *entry;
+    struct stat info;
+
+    if(directoryLength == 0) strcpy(directory, ".");
+    else snprintf(directory, sizeof(directory), "%.*s", (int)directoryLength, word);
+
+    DIR *listing = opendir(directory);
+    if(listing == NULL) return;
+    while((entry = readdir(listing)) != NULL) {
+        if(strncmp(entry->d_name, prefix, prefixLength) != 0) continue;
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        // Hidden files only when asked for with a leading dot.
+        if(entry->d_name[0] == '.' && prefixLength == 0) continue;
+
+        int isDirectory = entry->d_type == DT_DIR;
+        if(entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            isDirectory = fstatat(dirfd(listing), entry->d_name, &info, 0) == 0 && S_ISDIR(info.st_mode);
+        }
+        snprintf(candidate, sizeof(candidate), "%.*s%s%s", (int)directoryLength, word, entry->d_name, isDirectory ? "/" : "");
+        addMatch(matches, candidate);
+    }
+    closedir(listing);
+}
+
+/* Brings the trie up to date with PATH. Directories that left PATH give
+ * their names back, new ones are added, and the rest are only read again
+ * if their mtime changed since the last scan.
+ */
+void updateCommandTrie() {
+    const char *pathValue = getenv("PATH");
+    struct stat info;
+
+    if(pathValue == NULL) pathValue = "/bin:/usr/bin";
+
+    if(commandTrie.nodes == NULL) {
+        commandTrie.nodeCapacity = 1024;
+        commandTrie.nodes = malloc(commandTrie.nodeCapacity * sizeof(struct trieNode));
+        commandTrie.nodes[0] = (struct trieNode){-1, -1, 0, '\0'};
+        commandTrie.nodeCount = 1;
+
+        for(size_t i = 0; i < sizeof(shellCommands) / sizeof(shellCommands[0]); i++) trieAdjust(shellCommands[i], 1);
+        addBuiltinNames();
+    }
+
+    if(commandTrie.pathValue == NULL || strcmp(commandTrie.pathValue, pathValue) != 0) {
+        for(int i = 0; i < commandTrie.directoryCount; i++) commandTrie.directories[i].inPath = 0;
+
+        char *copy = strdup(pathValue);
+        char *saveptr;
+        for(char *path = strtok_r(copy, ":", &saveptr); path != NULL; path = strtok_r(NULL, ":", &saveptr)) {
+            int found = 0;
+            for(int i = 0; i < commandTrie.directoryCount && !found; i++) {
+                if(strcmp(commandTrie.directories[i].path, path) == 0) {
+                    commandTrie.directories[i].inPath = 1;
+                    found = 1;
+                }
+            }
+            if(found) continue;
+            commandTrie.directories = realloc(commandTrie.directories, (commandTrie.directoryCount + 1) * sizeof(struct pathDirectory));
+            commandTrie.directories[commandTrie.directoryCount++] = (struct pathDirectory){strdup(path), {0, 0}, NULL, 0, 1};
+        }
+        free(copy);
+
+        // Drop the directories that are no longer on PATH.
+        int kept = 0;
+        for(int i = 0; i < commandTrie.directoryCount; i++) {
+            if(commandTrie.directories[i].inPath) {
+                commandTrie.directories[kept++] = commandTrie.directories[i];
+            } else {
+                forgetDirectory(&commandTrie.directories[i]);
+                free(commandTrie.directories[i].path);
+            }
+        }
+        commandTrie.directoryCount = kept;
+        free(commandTrie.pathValue);
+        commandTrie.pathValue = strdup(pathValue);
+    }
+
+    for(int i = 0; i < commandTrie.directoryCount; i++) {
+        struct pathDirectory *directory = &commandTrie.directories[i];
+        if(stat(directory->path, &info) == -1) {
+            forgetDirectory(directory);
+            directory->mtime = (struct timespec){0, 0};
+        } else if(info.st_mtim.tv_sec != directory->mtime.tv_sec || info.st_mtim.tv_nsec != directory->mtime.tv_nsec) {
+            directory->mtime = info.st_mtim;
+            scanDirectory(directory);
+        }
+    }
+}
+
+// Returns the child of node for letter, adding it if create is set, or -1.
+int trieChild(int node, char letter, int create) {
+    int child;
+
+    for(child = commandTrie.nodes[node].child; child != -1; child = commandTrie.nodes[child].sibling) {
+        if(commandTrie.nodes[child].letter == letter) return child;
+    }
+    if(!create) return -1;
+
+    if(commandTrie.nodeCount == commandTrie.nodeCapacity) {
+        commandTrie.nodeCapacity *= 2;
+        commandTrie.nodes = realloc(commandTrie.nodes, commandTrie.nodeCapacity * sizeof(struct trieNode));
+    }
+    child = commandTrie.nodeCount++;
+    commandTrie.nodes[child] = (struct trieNode){-1, commandTrie.nodes[node].child, 0, letter};
+    commandTrie.nodes[node].child = child;
+    return child;
+}
+
+// Adds delta to the count of name, creating its nodes when adding.
+void trieAdjust(const char *name, int delta) {
+    int node = 0;
+
+    for(const char *letter = name; *letter != '\0' && node != -1; letter++) node = trieChild(node, *letter, delta > 0);
+    if(node != -1) commandTrie.nodes[node].count += delta;
+}
+
+// Adds every name at or below node, where name holds the letters so far.
+void trieCollect(int node, char *name, size_t length, struct matchList *matches) {
+    if(commandTrie.nodes[node].count > 0) {
+        name[length] = '\0';
+        addMatch(matches, name);
+    }
+    if(length >= NAME_MAX) return;
+    for(int child = commandTrie.nodes[node].child; child != -1; child = commandTrie.nodes[child].sibling) {
+        name[length] = commandTrie.nodes[child].letter;
+        trieCollect(child, name, length + 1, matches);
+    }
+}
+
+// Reads the executables in a directory, replacing the names it had before.
+void scanDirectory(struct pathDirectory *directory) {
+    struct dirent *entry;
+    struct stat info;
+    size_t capacity = 4096;
+
+    forgetDirectory(directory);
+    DIR *listing = opendir(directory->path);
+    if(listing == NULL) return;
+
+    directory->names = malloc(capacity);
+    while((entry = readdir(listing)) != NULL) {
+        if(entry->d_name[0] == '.') continue;
+        if(entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) continue;
+        if(fstatat(dirfd(listing), entry->d_name, &info, 0) == -1 || !S_ISREG(info.st_mode) || (info.st_mode & 0111) == 0) continue;
+
+        size_t length = strlen(entry->d_name) + 1;
+        if(directory->namesLength + length > capacity) {
+            while(directory->namesLength + length > capacity) capacity *= 2;
+            directory->names = realloc(directory->names, capacity);
+        }
+        memcpy(directory->names + directory->namesLength, entry->d_name, length);
+        directory->namesLength += length;
+        trieAdjust(entry->d_name, 1);
+    }
+    closedir(listing);
+}
+
+// Takes the names a directory added back out of the trie.
+void forgetDirectory(struct pathDirectory *directory) {
+    for(size_t offset = 0; offset < directory->namesLength; offset += strlen(directory->names + offset) + 1) {
+        trieAdjust(directory->names + offset, -1);
+    }
+    free(directory->names);
+    directory->names = NULL;
+    directory->namesLength = 0;
+}
+
+// USER COMMANDS AFTER VERIFICATION
+
+/* Citation for the following function: changeDirectory()
+   Date: 01/28/2022
+   Adapted from: clarification on how to find a path of unknown value
+   Source URL: https://stackoverflow.com/questions/298510/how-to-get-the-current-directory-in-a-c-program
+*/
+void changeDirectory(struct stage *stage) {
+    /* Depending on the context of the command
+     * this will change the directory.
+     * cd -> will go to $HOME
+     * cd /[directory] -> will search and go to the directory
+     * cd [directory] -> will sanitize the entry and go to the directory
+     * if the directory doesn't exist an error will print.
+     */
+    char *envPath;
+    int changeDir;
+
+    // Path into the $HOME directory
+    if(stage->argc == 1){
+        envPath = getenv("HOME");
+        changeDir = chdir(envPath);
+        if(changeDir == -1){
+            perror("chdir() failure: \n");
+        } 
+    } else {
+        char *directory = stage->argv[1];
+        // Path into an absolute path startin with /
+        if(directory[0] == '/') {
+            changeDir = chdir(directory);
+            if(changeDir == -1){
+                perror("chdir() failure: \n");
+            }
+        } else {
+            // Path into a relative directory.
+            envPath = arenaAlloc(&lineArena, strlen(directory) + 3);
+            sprintf(envPath, "./%s", directory);
+            changeDir = chdir(envPath);
+            if(changeDir == -1){
+                perror("chdir() failure: \n");
+            }
+        }   
+    }
+    // So that cd dir && command only runs in dir.
+    currStatus.lastStatus = changeDir == -1 ? 1 : 0;
+}
+
+// BUILTINS THAT RUN INSIDE THE SHELL
+/* echo, true, false, pwd, test, [, printf and kill are common in scripts
+ * and quick to do, so a foreground one runs inside the shell instead of
+ * paying for a fork and exec. Redirects still apply: the shell's own stdin
+ * and stdout are pointed at the files while the builtin runs and put back
+ * afterwards. In a pipeline or the background the programs of the same
+ * name are run as usual. Each returns its exit status.
+ */
+struct builtin {
+    const char *name;
+    int (*run)(int argc, char **argv);
+};
+
+static struct builtin builtins[] = {
+    {"echo", echoCommand},
+    {"true", trueCommand},
+    {"false", falseCommand},
+    {"pwd", pwdCommand},
+    {"printf", printfCommand},
+    {"test", testCommand},
+    {"[", testCommand},
+    {"kill", killCommand},
+};
+
+struct builtin *findBuiltin(const char *name) {
+    for(size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if(strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
+// Adds every builtin to the names the line editor completes.
+void addBuiltinNames() {
+    for(size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) trieAdjust(builtins[i].name, 1);
+}
+
+void runBuiltin(struct stage *stage, struct builtin *builtin) {
+    int inputFD, outputFD;
+    int savedInput = -1, savedOutput = -1;
+
+    if(openRedirects(stage->input, stage->output, &inputFD, &outputFD) == -1) return;
+
+    fflush(stdout);
+    if(inputFD != -1) {
+        savedInput = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(inputFD, STDIN_FILENO);
+        close(inputFD);
+    }
+    if(outputFD != -1) {
+        savedOutput = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(outputFD, STDOUT_FILENO);
+        close(outputFD);
+    }
+
+    long long started = traceStart();
+    int result = builtin->run(stage->argc, stage->argv);
+    traceEnd("builtin", started, 0);
+
+    fflush(stdout);
+    if(savedInput != -1) {
+        dup2(savedInput, STDIN_FILENO);
+        close(savedInput);
+    }
+    if(savedOutput != -1) {
+        dup2(savedOutput, STDOUT_FILENO);
+        close(savedOutput);
+    }
+    currStatus.lastStatus = result == 0 ? 0 : 1;
+}
+
+/* Prints the backslash escape that starts after the backslash and returns
+ * where the text continues. echo and %b write octal as \0nnn, a printf
+ * format as \nnn. \c sets stop, which ends all output.
+ */
+const char *printEscape(const char *escape, int echoStyle, int *stop) {
+    // Pairs of the letter after the backslash and the character it stands for.
+    const char *plain = "\\\\" "a\a" "b\b" "e\033" "f\f" "n\n" "r\r" "t\t" "v\v";
+    int value = 0, digits = 0;
+
+    for(const char *known = plain; *known != '\0'; known += 2) {
+        if(*escape == known[0]) {
+            putchar(known[1]);
+            return escape + 1;
+        }
+    }
+    if(*escape == 'c') {
+        *stop = 1;
+        return escape + 1;
+    }
+    if(*escape == 'x' && escape[1] != '\0' && strchr("0123456789abcdefABCDEF", escape[1]) != NULL) {
+        escape++;
+        while(digits < 2 && *escape != '\0' && strchr("0123456789abcdefABCDEF", *escape) != NULL) {
+            value = value * 16 + (*escape <= '9' ? *escape - '0' : (*escape | 0x20) - 'a' + 10);
+            escape++;
+            digits++;
+        }
+        putchar(value);
+        return escape;
+    }
+    if(*escape >= '0' && *escape <= '7') {
+        if(echoStyle && *escape == '0') escape++;
+        while(digits < 3 && *escape >= '0' && *escape <= '7') {
+            value = value * 8 + *escape++ - '0';
+            digits++;
+        }
+        putchar(value);
+        return escape;
+    }
+    // Not an escape, keep the backslash.
+    putchar('\\');
+    return escape;
+}
+
+// echo [-neE] [words]
+int echoCommand(int argc, char **argv) {
+    int newline = 1, escapes = 0, stop = 0;
+    int i = 1;
+
+    for(; i < argc && argv[i][0] == '-' && argv[i][1] != '\0' && strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1); i++) {
+        for(char *option = argv[i] + 1; *option != '\0'; option++) {
+            if(*option == 'n') newline = 0;
+            else escapes = *option == 'e';
+        }
+    }
+
+    for(int first = i; i < argc && !stop; i++) {
+        if(i > first) putchar(' ');
+        if(!escapes) {
+            fputs(argv[i], stdout);
+            continue;
+        }
+        for(const char *text = argv[i]; *text != '\0' && !stop;) {
+            if(*text == '\\' && text[1] != '\0') text = printEscape(text + 1, 1, &stop);
+            else putchar(*text++);
+        }
+    }
+    if(newline && !stop) putchar('\n');
+    return 0;
+}
+
+int trueCommand(int argc, char **argv) {
+    return 0;
+}
+
+int falseCommand(int argc, char **argv) {
+    return 1;
+}
+
+int pwdCommand(int argc, char **argv) {
+    char directory[PATH_MAX];
+
+    if(getcwd(directory, sizeof(directory)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    puts(directory);
+    return 0;
+}
+
+/* printf format [arguments]
+ * The format is used again until every argument has been consumed.
+ */
+int printfCommand(int argc, char **argv) {
+    char **args = argv + 2;
+    int remaining = argc - 2;
+    int stop = 0;
+    int status = 0;
+
+    if(argc < 2) {
+        fprintf(stderr, "usage: printf format [arguments]\n");
+        return 1;
+    }
+    do {
+        int before = remaining;
+        status |= printFormat(argv[1], &args, &remaining, &stop);
+        if(remaining == before) break;
+    } while(remaining > 0 && !stop);
+    return status;
+}
+
+/* Prints the format once. Each conversion, with its flags, width and
+ * precision, is handed to printf with the argument converted to the type it
+ * expects. Missing arguments count as empty or 0.
+ */
+int printFormat(const char *format, char ***args, int *remaining, int *stop) {
+    char spec[64];
+    int status = 0;
+
+    while(*format != '\0' && !*stop) {
+        if(*format == '\\' && format[1] != '\0') {
+            format = printEscape(format + 1, 0, stop);
+            continue;
+        }
+        if(*format != '%') {
+            putchar(*format++);
+            continue;
+        }
+        if(format[1] == '%') {
+            putchar('%');
+            format += 2;
+            continue;
+        }
+
+        // Copy the conversion, replacing a * width or precision with its argument.
+        size_t length = 0;
+        spec[length++] = *format++;
+        while(*format != '\0' && strchr("-+ #0123456789.*", *format) != NULL && length < sizeof(spec) - 16) {
+            if(*format == '*') {
+                length += snprintf(spec + length, sizeof(spec) - length, "%d", *remaining > 0 ? atoi(*(*args)++) : 0);
+                if(*remaining > 0) (*remaining)--;
+                format++;
+            } else {
+                spec[length++] = *format++;
+            }
+        }
+        char conversion = *format;
+        if(conversion == '\0' || strchr("diouxXeEfFgGaAcsb", conversion) == NULL) {
+            fprintf(stderr, "printf: %%%c: invalid conversion\n", conversion);
+            return 1;
+        }
+        format++;
+
+        char *arg = "";
+        if(*remaining > 0) {
+            arg = *(*args)++;
+            (*remaining)--;
+        }
+
+        if(conversion == 'b') {
+            for(const char *text = arg; *text != '\0' && !*stop;) {
+                if(*text == '\\' && text[1] != '\0') text = printEscape(text + 1, 1, stop);
+                else putchar(*text++);
+            }
+            continue;
+        }
+        if(conversion == 's') {
+            spec[length++] = 's';
+            spec[length] = '\0';
+            printf(spec, arg);
+            continue;
+        }
+        if(conversion == 'c') {
+            spec[length++] = 'c';
+            spec[length] = '\0';
+            printf(spec, arg[0]);
+            continue;
+        }
+
+        // Numbers, where 'a or "a stands for the code of the character.
+        char *end = arg;
+        int quoted = arg[0] == '\'' || arg[0] == '"';
+        if(strchr("eEfFgGaA", conversion) != NULL) {
+            double value = quoted ? (unsigned char)arg[1] : strtod(arg, &end);
+            spec[length++] = conversion;
+            spec[length] = '\0';
+            printf(spec, value);
+        } else {
+            long long value = quoted ? (unsigned char)arg[1] : strtoll(arg, &end, 0);
+            spec[length++] = 'l';
+            spec[length++] = 'l';
+            spec[length++] = conversion;
+            spec[length] = '\0';
+            printf(spec, value);
+        }
+        if(!quoted && arg[0] != '\0' && *end != '\0') {
+            fprintf(stderr, "printf: %s: invalid number\n", arg);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* test expression, or [ expression ]
+ *   expression: ! expression, expression -a expression,
+ *               expression -o expression, ( expression ),
+ *               -e -f -d -r -w -x -s -L -h -p -S -b -c file,
+ *               -n -z string, string, string = != string,
+ *               number -eq -ne -lt -le -gt -ge number
+ * Returns 0 when true, 1 when false and 2 for a malformed expression.
+ */
+struct testParser {
+    char **words;
+    int count;
+    int position;
+    int error;
+};
+
+int testCommand(int argc, char **argv) {
+    struct testParser parser = {argv + 1, argc - 1, 0, 0};
+
+    if(strcmp(argv[0], "[") == 0) {
+        if(argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        parser.count--;
+    }
+    if(parser.count == 0) return 1;
+
+    int result = testOr(&parser);
+    if(!parser.error && parser.position < parser.count) {
+        fprintf(stderr, "test: %s: unexpected argument\n", parser.words[parser.position]);
+        parser.error = 1;
+    }
+    if(parser.error) return 2;
+    return result ? 0 : 1;
+}
+
+int testOr(struct testParser *parser) {
+    int result = testAnd(parser);
+    while(parser->position < parser->count && strcmp(parser->words[parser->position], "-o") == 0) {
+        parser->position++;
+        result = testAnd(parser) || result;
+    }
+    return result;
+}
+
+int testAnd(struct testParser *parser) {
+    int result = testNot(parser);
+    while(parser->position < parser->count && strcmp(parser->words[parser->position], "-a") == 0) {
+        parser->position++;
+        result = testNot(parser) && result;
+    }
+    return result;
+}
+
+int testNot(struct testParser *parser) {
+    // A lone ! is a string, not an operator.
+    if(parser->position + 1 < parser->count && strcmp(parser->words[parser->position], "!") == 0) {
+        parser->position++;
+        return !testNot(parser);
+    }
+    return testPrimary(parser);
+}
+
+int testPrimary(struct testParser *parser) {
+    const char *binaries[] = {"=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    char **word = parser->words + parser->position;
+    int left = parser->count - parser->position;
+
+    if(left <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        parser->error = 1;
+        return 0;
+    }
+
+    // Binary operators take priority, so [ -n = -n ] compares two strings.
+    if(left >= 3) {
+        for(int i = 0; i < 8; i++) {
+            if(strcmp(word[1], binaries[i]) != 0) continue;
+            parser->position += 3;
+            if(i == 0) return strcmp(word[0], word[2]) == 0;
+            if(i == 1) return strcmp(word[0], word[2]) != 0;
+
+            char *leftEnd, *rightEnd;
+            long long a = strtoll(word[0], &leftEnd, 10), b = strtoll(word[2], &rightEnd, 10);
+            if(*word[0] == '\0' || *leftEnd != '\0' || *word[2] == '\0' || *rightEnd != '\0') {
+                fprintf(stderr, "test: integer expression expected\n");
+                parser->error = 1;
+                return 0;
+            }
+            switch(i) {
+            case 2: return a == b;
+            case 3: return a != b;
+            case 4: return a < b;
+            case 5: return a <= b;
+            case 6: return a > b;
+            default: return a >= b;
+            }
+        }
+    }
+
+    if(strcmp(word[0], "(") == 0 && left >= 3) {
+        parser->position++;
+        int result = testOr(parser);
+        if(parser->position >= parser->count || strcmp(parser->words[parser->position], ")") != 0) {
+            fprintf(stderr, "test: missing )\n");
+            parser->error = 1;
+            return 0;
+        }
+        parser->position++;
+        return result;
+    }
+
+    if(left >= 2 && word[0][0] == '-' && word[0][1] != '\0' && word[0][2] == '\0' && strchr("efdrwxsLhpSbcnz", word[0][1]) != NULL) {
+        parser->position += 2;
+        if(word[0][1] == 'n') return word[1][0] != '\0';
+        if(word[0][1] == 'z') return word[1][0] == '\0';
+        return testFile(word[0], word[1]);
+    }
+
+    parser->position++;
+    return word[0][0] != '\0';
+}
+
+int testFile(const char *op, const char *path) {
+    struct stat info;
+
+    switch(op[1]) {
+    case 'r': return access(path, R_OK) == 0;
+    case 'w': return access(path, W_OK) == 0;
+    case 'x': return access(path, X_OK) == 0;
+    case 'L':
+    case 'h': return lstat(path, &info) == 0 && S_ISLNK(info.st_mode);
+    }
+    if(stat(path, &info) == -1) return 0;
+    switch(op[1]) {
+    case 'f': return S_ISREG(info.st_mode);
+    case 'd': return S_ISDIR(info.st_mode);
+    case 's': return info.st_size > 0;
+    case 'p': return S_ISFIFO(info.st_mode);
+    case 'S': return S_ISSOCK(info.st_mode);
+    case 'b': return S_ISBLK(info.st_mode);
+    case 'c': return S_ISCHR(info.st_mode);
+    default: return 1;
+    }
+}
+
+static struct {
+    const char *name;
+    int number;
+} signalNames[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH},
+};
+
+// Signal number for a name such as TERM or SIGTERM, or a number. -1 if unknown.
+int signalNumber(const char *name) {
+    char *end;
+    long number = strtol(name, &end, 10);
+
+    if(*name != '\0' && *end == '\0') return number >= 0 && number < NSIG ? number : -1;
+    if(strncmp(name, "SIG", 3) == 0) name += 3;
+    for(size_t i = 0; i < sizeof(signalNames) / sizeof(signalNames[0]); i++) {
+        if(strcmp(signalNames[i].name, name) == 0) return signalNames[i].number;
+    }
+    return -1;
+}
+
+/* kill [-s signal | -signal] pid | %job ...
+ * kill -l lists the signal names. A job is signalled in every process of it
+ * that is still running.
+ */
+int killCommand(int argc, char **argv) {
+    int signal = SIGTERM;
+    int status = 0;
+    int i = 1;
+
+    if(argc == 2 && strcmp(argv[1], "-l") == 0) {
+        for(size_t j = 0; j < sizeof(signalNames) / sizeof(signalNames[0]); j++) {
+            printf("%d) SIG%s\n", signalNames[j].number, signalNames[j].name);
+        }
+        return 0;
+    }
+    if(i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+        const char *name = argv[i] + 1;
+        if(strcmp(argv[i], "-s") == 0) name = ++i < argc ? argv[i] : "";
+        signal = signalNumber(name);
+        if(signal == -1) {
+            fprintf(stderr, "kill: %s: invalid signal\n", name);
+            return 1;
+        }
+        i++;
+    }
+    if(i >= argc) {
+        fprintf(stderr, "usage: kill [-s signal | -signal] pid | %%job ...\n");
+        return 1;
+    }
+
+    for(; i < argc; i++) {
+        if(argv[i][0] == '%') {
+            int slot = findJob(argv[i]);
+            if(slot == -1) {
+                fprintf(stderr, "kill: %s: no such job\n", argv[i]);
+                status = 1;
+                continue;
+            }
+            signalJob(slot, signal);
+            continue;
+        }
+
+        char *end;
+        long pid = strtol(argv[i], &end, 10);
+        if(argv[i][0] == '\0' || *end != '\0') {
+            fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", argv[i]);
+            status = 1;
+        } else if(kill(pid, signal) == -1) {
+            fprintf(stderr, "kill: (%ld) - %s\n", pid, strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// FILE REDIRECTION FUNCTIONS
+/* Citation for the following function: redirectProcess()
+   Date: 01/30/2022
+   Adapted from: How to perform file redirection in modules
+   Source URL: https://canvas.oregonstate.edu/courses/1884946/pages/exploration-processes-and-i-slash-o?module_item_id=21835982
+   */
+/* Citation for the following function: redirectProcess()
+   Date: 01/30/2022
+   Adapted from: how to check status on child failure/completion
+   Source URL: https://stackoverflow.com/questions/13735501/fork-exec-waitpid-issue
+*/
+void redirectProcess(struct command *cmd, int type) {
+    /* This is for process redirect of an input file or output file or both.
+     * The lexer has already pulled the < and > files out of the words, a
+     * redirect with no file after it is routed to /dev/null. The launch
+     * engine opens them and applies the redirects in the child.
+     */
+    struct stage *stage = &cmd->stages[0];
+
+    if(type == 0 && currStatus.limits == NULL && currStatus.placement == NULL && copyInProcess(stage) == 0) return;
+
+    pid_t childID = launchProcess(stage->argv, stage->input, stage->output, type);
+    if(childID == -1) return;
+
+    if(type == 0) {
+        waitForeground(childID);
+    } else {
+        startBackgroundJob(cmd, &childID, 1);
+    }
+}
+
+// IN-PROCESS COPY
+/* cat < in > out and cat in > out only copy one file into another, so the
+ * shell does the copy itself instead of starting cat. copy_file_range lets
+ * the kernel copy or share the blocks without the data passing through
+ * user space, and sendfile covers the cases it refuses, like copies
+ * between filesystems on older kernels. Only a foreground cat of a
+ * non-empty regular file takes this path. Pipes, devices, /proc files
+ * (which report a size of 0), options and files that fail to open all run
+ * the real cat, so errors look the same. SMALLSH_FASTCOPY=0 turns it off.
+ * Returns 0 when the command was handled, or -1 to run it normally.
+ */
+int copyInProcess(struct stage *stage) {
+    struct stat inputInfo, outputInfo;
+    const char *source;
+
+    if(!currStatus.fastCopy || stage->output == NULL || strcmp(stage->argv[0], "cat") != 0) return -1;
+    if(stage->argc == 1 && stage->input != NULL) {
+        source = stage->input;
+    } else if(stage->argc == 2 && stage->input == NULL && stage->argv[1][0] != '-') {
+        source = stage->argv[1];
+    } else {
+        return -1;
+    }
+
+    int inputFD = open(source, O_RDONLY | O_CLOEXEC);
+    if(inputFD == -1) return -1;
+    if(fstat(inputFD, &inputInfo) == -1 || !S_ISREG(inputInfo.st_mode) || inputInfo.st_size == 0) {
+        close(inputFD);
+        return -1;
+    }
+
+    int outputFD = open(stage->output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(outputFD == -1) {
+        fprintf(stderr, "cannot open %s for output: %s\n", stage->output, strerror(errno));
+        close(inputFD);
+        currStatus.lastStatus = 1;
+        return 0;
+    }
+
+    long long started = traceStart();
+    if(fstat(outputFD, &outputInfo) == 0 && outputInfo.st_dev == inputInfo.st_dev && outputInfo.st_ino == inputInfo.st_ino) {
+        fprintf(stderr, "cat: %s: input file is output file\n", source);
+        currStatus.lastStatus = 1;
+    } else if(copyFile(inputFD, outputFD) == -1) {
+        fprintf(stderr, "cat: %s: %s\n", source, strerror(errno));
+        currStatus.lastStatus = 1;
+    } else {
+        currStatus.lastStatus = 0;
+    }
+    traceEnd("copy", started, 0);
+
+    close(inputFD);
+    close(outputFD);
+    return 0;
+}
+
+// Copies from the current offset of inputFD to its end. Returns 0 or -1.
+int copyFile(int inputFD, int outputFD) {
+    int useSendfile = 0;
+    ssize_t copied;
+
+    while(1) {
+        if(useSendfile) {
+            copied = sendfile(outputFD, inputFD, NULL, 1 << 30);
+        } else {
+            copied = copy_file_range(inputFD, NULL, outputFD, NULL, 1 << 30, 0);
+            if(copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                useSendfile = 1;
+                continue;
+            }
+        }
+        if(copied == -1 && errno == EINTR) continue;
+        if(copied <= 0) return copied == 0 ? 0 : -1;
+    }
+}
+
+// LAUNCH ENGINE
+/* Every child the shell starts goes through startChild(). There are two
+ * backends. The default uses posix_spawn, which in glibc is built on
+ * clone(CLONE_VM|CLONE_VFORK), so the child never copies the shell's page
+ * tables no matter how large the heap grows. Redirects become dup2 file
+ * actions and signal dispositions become spawn attributes. The fork
+ * backend is the original fork/dup2/execvp path and is kept as a fallback.
+ * It can be picked with SMALLSH_LAUNCH=fork or the launch command.
+ */
+
+// Monotonic clock in nanoseconds, used for latency measurements.
+long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Reads the SMALLSH_ tuning variables from the environment when the shell
+ * starts.
+ * SMALLSH_LAUNCH=fork     -> use the fork backend
+ * SMALLSH_PIPE_SIZE=bytes -> resize every pipeline pipe with F_SETPIPE_SZ
+ */
+void initSettings() {
+    char *value = getenv("SMALLSH_LAUNCH");
+
+    currStatus.launchMode = LAUNCH_SPAWN;
+    if(value != NULL && strcmp(value, "fork") == 0) currStatus.launchMode = LAUNCH_FORK;
+
+    value = getenv("SMALLSH_PIPE_SIZE");
+    currStatus.pipeSize = value == NULL ? 0 : atoi(value);
+
+    value = getenv("SMALLSH_MAX_JOBS");
+    currStatus.maxJobs = value == NULL || atoi(value) < 0 ? 0 : atoi(value);
+
+    value = getenv("SMALLSH_FASTCOPY");
+    currStatus.fastCopy = value == NULL || strcmp(value, "0") != 0;
+
+    // $$ expands to this, so it is only formatted once.
+    currStatus.pidLength = snprintf(currStatus.pidString, sizeof(currStatus.pidString), "%d", getpid());
+
+    // Only a shell that owns the terminal hands it to foreground pipelines.
+    currStatus.shellGroup = getpgrp();
+    currStatus.interactive = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == currStatus.shellGroup;
+}
+
+// Add one launch to the running latency numbers of a backend.
+void recordLaunchLatency(int mode, long long elapsed) {
+    struct launchStats *stats = &currStatus.launchStats[mode];
+
+    if(stats->count == 0 || elapsed < stats->minNs) stats->minNs = elapsed;
+    if(elapsed > stats->maxNs) stats->maxNs = elapsed;
+    stats->totalNs += elapsed;
+    stats->count++;
+}
+
+/* Opens the redirect targets in the shell. The descriptors are close on exec
+ * so only the dup2 copies on 0 and 1 survive into the child. Returns -1 and
+ * sets the status if a file can't be opened.
+ */
+int openRedirects(const char *input, const char *output, int *inputFD, int *outputFD) {
+    *inputFD = -1;
+    *outputFD = -1;
+
+    if(input != NULL) {
+        *inputFD = open(input, O_RDONLY | O_CLOEXEC);
+        if(*inputFD == -1) {
+            fprintf(stderr, "cannot open %s for input: %s\n", input, strerror(errno));
+            currStatus.lastStatus = 1;
+            return -1;
+        }
+    }
+
+    if(output != NULL) {
+        *outputFD = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(*outputFD == -1) {
+            fprintf(stderr, "cannot open %s for output: %s\n", output, strerror(errno));
+            if(*inputFD != -1) close(*inputFD);
+            currStatus.lastStatus = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* posix_spawn backend. Returns the child's pid or -1 with errno set.
+ * Every child ignores ctrl-z. posix_spawn can only pass on an ignored
+ * disposition, so SIGTSTP is ignored in the shell for the length of the
+ * call. It is blocked at the same time so a ctrl-z in that window still
+ * reaches the shell's handler afterwards.
+ */
+pid_t spawnChild(const char *path, struct launchRequest *request) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    sigset_t mask;
+    sigset_t stopSignal;
+    sigset_t savedMask;
+    struct sigaction ignore = {{0}};
+    struct sigaction savedAction;
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    if(request->inputFD != -1) posix_spawn_file_actions_adddup2(&actions, request->inputFD, STDIN_FILENO);
+    if(request->outputFD != -1) posix_spawn_file_actions_adddup2(&actions, request->outputFD, STDOUT_FILENO);
+
+    // The shell ignores SIGINT and SIGTTOU. A foreground child gets the
+    // default SIGINT back so ctrl-c stops it, a background child keeps
+    // ignoring it.
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    if(request->type == 0) sigaddset(&defaults, SIGINT);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    if(request->processGroup != -1) {
+        posix_spawnattr_setpgroup(&attr, request->processGroup);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    sigemptyset(&stopSignal);
+    sigaddset(&stopSignal, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &stopSignal, &savedMask);
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &ignore, &savedAction);
+
+    int result = posix_spawn(&pid, path, &actions, &attr, request->argv, environ);
+
+    sigaction(SIGTSTP, &savedAction, NULL);
+    sigprocmask(SIG_SETMASK, &savedMask, NULL);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if(result != 0) {
+        errno = result;
+        return -1;
+    }
+    return pid;
+}
+
+/* fork backend. Returns the child's pid or -1 with errno set. A close on
+ * exec pipe carries the child's errno back if the exec fails, so both
+ * backends report launch errors the same way.
+ */
+pid_t forkChild(const char *path, struct launchRequest *request) {
+    int errorPipe[2];
+
+    if(pipe2(errorPipe, O_CLOEXEC) == -1) return -1;
+
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        sigset_t noSignals;
+        sigemptyset(&noSignals);
+        sigprocmask(SIG_SETMASK, &noSignals, NULL);
+        signal(SIGINT, request->type == 0 ? SIG_DFL : SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTOU, SIG_DFL);
+        if(request->processGroup != -1) setpgid(0, request->processGroup);
+        if(applyLimits(currStatus.limits) == 0 && applyPlacement(request->placement) == 0 &&
+           (request->inputFD == -1 || dup2(request->inputFD, STDIN_FILENO) != -1) &&
+           (request->outputFD == -1 || dup2(request->outputFD, STDOUT_FILENO) != -1)) {
+            execv(path, request->argv);
+        }
+        int childError = errno;
+        write(errorPipe[1], &childError, sizeof(childError));
+        _exit(1);
+    }
+
+    int forkError = errno;
+    close(errorPipe[1]);
+    if(pid == -1) {
+        close(errorPipe[0]);
+        errno = forkError;
+        return -1;
+    }
+
+    // Set the group from this side too so it exists before the next
+    // pipeline stage tries to join it.
+    if(request->processGroup != -1) {
+        setpgid(pid, request->processGroup == 0 ? pid : request->processGroup);
+    }
+
+    int childError;
+    ssize_t bytes;
+    while((bytes = read(errorPipe[0], &childError, sizeof(childError))) == -1 && errno == EINTR);
+    close(errorPipe[0]);
+
+    if(bytes == sizeof(childError)) {
+        waitpid(pid, NULL, 0);
+        errno = childError;
+        return -1;
+    }
+    return pid;
+}
+
+/* Starts the child described by request on the selected backend. Returns
+ * the child's pid, or -1 after reporting the error and setting the status.
+ */
+pid_t startChild(struct launchRequest *request) {
+    char **argv = request->argv;
+    // The parts of a background list are started like background jobs.
+    if(currStatus.backgroundList) request->type = 1;
+    // posix_spawn has no way to run setrlimit, sched_setaffinity and the
+    // rest in the child before the exec.
+    request->placement = choosePlacement(request);
+    int mode = currStatus.limits != NULL || request->placement != NULL ? LAUNCH_FORK : currStatus.launchMode;
+    int launchError = ENOENT;
+    pid_t pid = -1;
+
+    fflush(stdout);
+    // A second attempt is only made when a cached path has disappeared.
+    for(int attempt = 0; attempt < 2; attempt++) {
+        const char *path = resolveCommand(argv[0]);
+        if(path == NULL) break;
+
+        long long started = nowNs();
+        pid = mode == LAUNCH_FORK ? forkChild(path, request) : spawnChild(path, request);
+        launchError = errno;
+        recordLaunchLatency(mode, nowNs() - started);
+        traceEnd(mode == LAUNCH_FORK ? "fork" : "spawn", started, pid);
+
+        if(pid != -1 || launchError != ENOENT || strchr(argv[0], '/') != NULL) break;
+        forgetCommand(argv[0]);
+    }
+
+    if(pid == -1) {
+        if(launchError == ENOENT && strchr(argv[0], '/') == NULL) {
+            fprintf(stderr, "%s: command not found\n", argv[0]);
+        } else {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(launchError));
+        }
+        currStatus.lastStatus = 1;
+    }
+    return pid;
+}
+
+/* Starts argv[0] with optional input and output files in the shell's own
+ * process group. type is 0 for a foreground and 1 for a background process.
+ * Returns the child's pid, or -1 after reporting the error.
+ */
+pid_t launchProcess(char *argv[], const char *input, const char *output, int type) {
+    struct launchRequest request = {argv, -1, -1, type, -1};
+
+    if(openRedirects(input, output, &request.inputFD, &request.outputFD) == -1) return -1;
+
+    pid_t pid = startChild(&request);
+
+    if(request.inputFD != -1) close(request.inputFD);
+    if(request.outputFD != -1) close(request.outputFD);
+    return pid;
+}
+
+// Show the launch backend and its latency, or switch to another backend.
+void launchCommand(struct stage *stage) {
+    const char *names[] = {"spawn", "fork"};
+
+    if(stage->argc > 1) {
+        if(strcmp(stage->argv[1], "spawn") == 0) currStatus.launchMode = LAUNCH_SPAWN;
+        else if(strcmp(stage->argv[1], "fork") == 0) currStatus.launchMode = LAUNCH_FORK;
+        else {
+            fprintf(stderr, "launch: unknown mode %s\n", stage->argv[1]);
+            currStatus.lastStatus = 1;
+            return;
+        }
+    }
+
+    printf("launch mode: %s\n", names[currStatus.launchMode]);
+    for(int mode = LAUNCH_SPAWN; mode <= LAUNCH_FORK; mode++) {
+        struct launchStats *stats = &currStatus.launchStats[mode];
+        if(stats->count == 0) {
+            printf("%s: 0 launches\n", names[mode]);
+            continue;
+        }
+        printf("%s: %ld launches, avg %lld us, min %lld us, max %lld us\n", names[mode],
+               stats->count, stats->totalNs / stats->count / 1000,
+               stats->minNs / 1000, stats->maxNs / 1000);
+    }
+    currStatus.lastStatus = 0;
+}
+
+// Waits on a foreground child and records how it finished.
+void waitForeground(pid_t pid) {
+    int childStatus;
+
+    if(waitChild(pid, &childStatus) == -1) {
+        perror("wait4()");
+        currStatus.lastStatus = 1;
+        return;
+    }
+    currStatus.lastLimit = limitReason(childStatus, currStatus.limits, &currStatus.commandUsage.rusage);
+    if(currStatus.lastLimit != NULL) {
+        printf("pid %d terminated: signal %d (%s)\n", pid, WTERMSIG(childStatus), currStatus.lastLimit);
+        currStatus.lastStatus = 1;
+        return;
+    }
+    if (WIFSIGNALED(childStatus)) {
+        printf("pid %d terminated: signal %d\n", pid, WTERMSIG(childStatus));
+        currStatus.lastStatus = 1;
+        return;
+    }
+    currStatus.lastStatus = WEXITSTATUS(childStatus) == 0 ? 0 : 1;
+}
+
+/* wait4 that also survives a stopped child. A pipeline that reads the
+ * terminal before the shell has handed it over is stopped with SIGTTIN,
+ * so it is continued and waited on again. The child's usage is added to
+ * the current command.
+ */
+int waitChild(pid_t pid, int *childStatus) {
+    struct rusage usage;
+    long long started = traceStart();
+
+    while(1) {
+        pid_t result = wait4(pid, childStatus, WUNTRACED, &usage);
+        if(result == -1 && errno == EINTR) continue;
+        if(result == -1) return -1;
+        if(!WIFSTOPPED(*childStatus)) break;
+        kill(pid, SIGCONT);
+    }
+    addUsage(&currStatus.commandUsage, &usage);
+    traceEnd("wait", started, pid);
+    return 0;
+}
+
+// RESOURCE LIMITS
+/* ulimit changes the limits of the shell itself, which every child
+ * inherits. The limit prefix gives them to one command only:
+ *
+ *   limit mem=2G cpu=60 nofile=1024 command ... [&]
+ *
+ * Sizes take a K, M or G suffix. The limits are set with setrlimit in the
+ * child between fork and exec, so a command run with limit always uses
+ * the fork backend. Every process of a pipeline gets the same limits.
+ * A process ended by a limit is reported with the limit's name.
+ */
+struct limitName {
+    const char *name;
+    int resource;
+    char option;
+    rlim_t unit;        // ulimit counts in these, limit takes bytes
+    const char *description;
+};
+
+static struct limitName limitNames[] = {
+    {"cpu", RLIMIT_CPU, 't', 1, "cpu time (seconds)"},
+    {"mem", RLIMIT_AS, 'v', 1024, "virtual memory (kbytes)"},
+    {"data", RLIMIT_DATA, 'd', 1024, "data seg size (kbytes)"},
+    {"stack", RLIMIT_STACK, 's', 1024, "stack size (kbytes)"},
+    {"fsize", RLIMIT_FSIZE, 'f', 1024, "file size (blocks)"},
+    {"core", RLIMIT_CORE, 'c', 1024, "core file size (blocks)"},
+    {"nofile", RLIMIT_NOFILE, 'n', 1, "open files"},
+    {"nproc", RLIMIT_NPROC, 'u', 1, "max user processes"},
+};
+
+// Index in limitNames[] of a limit by name or by ulimit option, or -1.
+int findLimit(const char *name, char option) {
+    for(size_t i = 0; i < sizeof(limitNames) / sizeof(limitNames[0]); i++) {
+        if(name != NULL ? strcmp(limitNames[i].name, name) == 0 : limitNames[i].option == option) return i;
+    }
+    return -1;
+}
+
+/* Reads a number of units, optionally followed by K, M or G, or the word
+ * unlimited. Returns -1 if text is neither.
+ */
+int parseLimit(const char *text, rlim_t unit, rlim_t *value) {
+    char *end;
+
+    if(strcmp(text, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    if(text[0] < '0' || text[0] > '9') return -1;
+
+    unsigned long long number = strtoull(text, &end, 10);
+    switch(*end) {
+    case 'k': case 'K': number *= 1024; end++; break;
+    case 'm': case 'M': number *= 1024 * 1024; end++; break;
+    case 'g': case 'G': number *= 1024ULL * 1024 * 1024; end++; break;
+    default: number *= unit; break;
+    }
+    if(*end != '\0') return -1;
+    *value = number;
+    return 0;
+}
+
+void printLimit(rlim_t value, rlim_t unit) {
+    if(value == RLIM_INFINITY) printf("unlimited\n");
+    else printf("%llu\n", (unsigned long long)(value / unit));
+}
+
+/* Sets limits on the calling process, run in a forked child. A limit can't
+ * go above the hard limit the child already has. The cpu hard limit is one
+ * second past the soft one, so the process gets SIGXCPU before SIGKILL.
+ * Returns -1 with errno set if one could not be set.
+ */
+int applyLimits(const struct jobLimits *limits) {
+    if(limits == NULL) return 0;
+
+    for(size_t i = 0; i < sizeof(limitNames) / sizeof(limitNames[0]); i++) {
+        struct rlimit limit;
+        if(!(limits->set & (1 << i)) || getrlimit(limitNames[i].resource, &limit) == -1) continue;
+
+        rlim_t hard = limits->values[i];
+        if(limitNames[i].resource == RLIMIT_CPU && hard != RLIM_INFINITY) hard++;
+        if(limit.rlim_max != RLIM_INFINITY && (hard == RLIM_INFINITY || hard > limit.rlim_max)) hard = limit.rlim_max;
+        limit.rlim_cur = limits->values[i] < hard ? limits->values[i] : hard;
+        limit.rlim_max = hard;
+        if(setrlimit(limitNames[i].resource, &limit) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Names the limit that ended a process, or returns NULL if it ended some
+ * other way. SIGXCPU and SIGXFSZ only come from limits. SIGKILL counts when
+ * a cpu limit was given and used up, and a crash counts as the memory
+ * limit when one was given, since running out of address space usually
+ * ends in a failed allocation.
+ */
+const char *limitReason(int childStatus, const struct jobLimits *limits, const struct rusage *usage) {
+    if(!WIFSIGNALED(childStatus)) return NULL;
+
+    int signal = WTERMSIG(childStatus);
+    if(signal == SIGXCPU) return "cpu limit";
+    if(signal == SIGXFSZ) return "file size limit";
+    if(limits == NULL) return NULL;
+
+    int cpu = findLimit("cpu", 0);
+    if(signal == SIGKILL && (limits->set & (1 << cpu)) &&
+       (rlim_t)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) >= limits->values[cpu]) return "cpu limit";
+    if((signal == SIGSEGV || signal == SIGABRT || signal == SIGBUS) &&
+       (limits->set & ((1 << findLimit("mem", 0)) | (1 << findLimit("data", 0))))) return "memory limit";
+    return NULL;
+}
+
+// limit name=value ... command. Runs the command with the limits given.
+void limitCommand(struct command *cmd) {
+    struct stage *first = &cmd->stages[0];
+    struct jobLimits limits = {0, {0}};
+    int words = 1;
+
+    for(; words < first->argc && strchr(first->argv[words], '=') != NULL; words++) {
+        char *word = first->argv[words];
+        char *equals = strchr(word, '=');
+
+        *equals = '\0';
+        int index = findLimit(word, 0);
+        if(index == -1 || parseLimit(equals + 1, 1, &limits.values[index]) == -1) {
+            fprintf(stderr, index == -1 ? "limit: unknown limit %s\n" : "limit: bad value for %s\n", word);
+            currStatus.lastStatus = 1;
+            return;
+        }
+        limits.set |= 1 << index;
+    }
+    if(words == first->argc) {
+        fprintf(stderr, "usage: limit name=value ... command\n");
+        currStatus.lastStatus = 1;
+        return;
+    }
+
+    first->argv += words;
+    first->argc -= words;
+    currStatus.limits = &limits;
+    activateCommands(cmd);
+    currStatus.limits = NULL;
+}
+
+/* The ulimit command.
+ * ulimit -a               -> show every limit
+ * ulimit [-S|-H] -n       -> show one limit, soft by default
+ * ulimit [-S|-H] -n value -> set it, both soft and hard without -S or -H
+ * With no option the file size limit (-f) is used.
+ */
+void ulimitCommand(struct stage *stage) {
+    int soft = 0, hard = 0, all = 0;
+    int index = findLimit("fsize", 0);
+    int i = 1;
+
+    currStatus.lastStatus = 1;
+    for(; i < stage->argc && stage->argv[i][0] == '-' && stage->argv[i][1] != '\0'; i++) {
+        for(char *option = stage->argv[i] + 1; *option != '\0'; option++) {
+            if(*option == 'S') soft = 1;
+            else if(*option == 'H') hard = 1;
+            else if(*option == 'a') all = 1;
+            else if((index = findLimit(NULL, *option)) == -1) {
+                fprintf(stderr, "ulimit: -%c: invalid option\n", *option);
+                return;
+            }
+        }
+    }
+
+    if(all) {
+        for(size_t j = 0; j < sizeof(limitNames) / sizeof(limitNames[0]); j++) {
+            struct rlimit limit;
+            getrlimit(limitNames[j].resource, &limit);
+            printf("%-28s(-%c) ", limitNames[j].description, limitNames[j].option);
+            printLimit(hard ? limit.rlim_max : limit.rlim_cur, limitNames[j].unit);
+        }
+        currStatus.lastStatus = 0;
+        return;
+    }
+
+    struct limitName *name = &limitNames[index];
+    struct rlimit limit;
+    getrlimit(name->resource, &limit);
+    if(i == stage->argc) {
+        printLimit(hard && !soft ? limit.rlim_max : limit.rlim_cur, name->unit);
+        currStatus.lastStatus = 0;
+        return;
+    }
+
+    rlim_t value;
+    if(parseLimit(stage->argv[i], name->unit, &value) == -1) {
+        fprintf(stderr, "ulimit: %s: invalid number\n", stage->argv[i]);
+        return;
+    }
+    if(!soft && !hard) soft = hard = 1;
+    if(hard) limit.rlim_max = value;
+    if(soft) limit.rlim_cur = value;
+    if(setrlimit(name->resource, &limit) == -1) {
+        fprintf(stderr, "ulimit: %s: %s\n", name->description, strerror(errno));
+        return;
+    }
+    currStatus.lastStatus = 0;
+}
+
+// PLACING BACKGROUND JOBS
+/* sched sets where background jobs run and how they are scheduled, so a
+ * heavy batch run doesn't take the cpus away from the foreground.
+ *
+ *   sched                         -> show the policy for background jobs
+ *   sched off                     -> remove it
+ *   sched setting=value ...       -> set it
+ *   sched setting=value ... cmd   -> run cmd, in front or behind, with them
+ *
+ *   cpus=1-3,6   cpus=spread   only run on those cpus. spread gives each
+ *                              job the next cpu in turn, leaving out the
+ *                              first one for the foreground.
+ *   nice=10                    the nice value
+ *   class=batch|idle|normal    SCHED_BATCH, SCHED_IDLE or SCHED_OTHER
+ *   io=idle|be:N|rt:N          the io priority class and level (0-7)
+ *
+ * Like limit, these are applied in the child between fork and exec, so a
+ * placed child always uses the fork backend.
+ */
+#define PLACE_CPUS 1
+#define PLACE_SPREAD 2
+#define PLACE_NICE 4
+#define PLACE_CLASS 8
+#define PLACE_IO 16
+
+// ioprio_set has no glibc wrapper.
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+struct placement {
+    int set;
+    cpu_set_t cpus;
+    char cpuText[32];
+    int nice;
+    int policy;
+    int ioClass;
+    int ioLevel;
+};
+
+static struct placement backgroundPlacement;
+
+/* Reads one setting=value word into placement. Returns 1 if the word is
+ * not a setting, so the command starts there, and -1 after reporting a
+ * bad value.
+ */
+int parsePlacement(char *word, struct placement *placement) {
+    char *value = strchr(word, '=');
+    char *end;
+
+    if(value == NULL) return 1;
+    value++;
+
+    if(strncmp(word, "cpus=", 5) == 0) {
+        if(strcmp(value, "spread") == 0) {
+            placement->set = (placement->set & ~PLACE_CPUS) | PLACE_SPREAD;
+            return 0;
+        }
+        CPU_ZERO(&placement->cpus);
+        for(char *range = value; *range != '\0'; range = end + (*end == ',')) {
+            long first = strtol(range, &end, 10), last = first;
+            if(end == range) break;
+            if(*end == '-') last = strtol(end + 1, &end, 10);
+            if(first < 0 || last < first || last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) break;
+            for(long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, &placement->cpus);
+            if(*end == '\0') {
+                snprintf(placement->cpuText, sizeof(placement->cpuText), "%s", value);
+                placement->set = (placement->set & ~PLACE_SPREAD) | PLACE_CPUS;
+                return 0;
+            }
+        }
+    } else if(strncmp(word, "nice=", 5) == 0) {
+        placement->nice = strtol(value, &end, 10);
+        if(end != value && *end == '\0' && placement->nice >= -20 && placement->nice <= 19) {
+            placement->set |= PLACE_NICE;
+            return 0;
+        }
+    } else if(strncmp(word, "class=", 6) == 0) {
+        placement->policy = strcmp(value, "batch") == 0 ? SCHED_BATCH : strcmp(value, "idle") == 0 ? SCHED_IDLE :
+                            strcmp(value, "normal") == 0 ? SCHED_OTHER : -1;
+        if(placement->policy != -1) {
+            placement->set |= PLACE_CLASS;
+            return 0;
+        }
+    } else if(strncmp(word, "io=", 3) == 0) {
+        placement->ioLevel = 0;
+        if(strcmp(value, "idle") == 0) {
+            placement->ioClass = 3;
+        } else if((strncmp(value, "rt:", 3) == 0 || strncmp(value, "be:", 3) == 0) && value[3] >= '0' && value[3] <= '7' && value[4] == '\0') {
+            placement->ioClass = value[0] == 'r' ? 1 : 2;
+            placement->ioLevel = value[3] - '0';
+        } else {
+            placement->ioClass = 0;
+        }
+        if(placement->ioClass != 0) {
+            placement->set |= PLACE_IO;
+            return 0;
+        }
+    } else {
+        return 1;
+    }
+    fprintf(stderr, "sched: bad setting %s\n", word);
+    return -1;
+}
+
+/* Picks the placement for a child about to start: the sched prefix of its
+ * command, or the background policy for a background child. With
+ * cpus=spread each new job moves on to the next cpu, and the later stages
+ * of a pipeline join the cpu of the first. Returns NULL if the child is
+ * started as usual.
+ */
+struct placement *choosePlacement(struct launchRequest *request) {
+    static struct placement chosen;
+    struct placement *policy = currStatus.placement;
+
+    if(policy == NULL && request->type == 1 && backgroundPlacement.set != 0) policy = &backgroundPlacement;
+    currStatus.placementText[0] = '\0';
+    if(policy == NULL) return NULL;
+
+    chosen = *policy;
+    if(chosen.set & PLACE_SPREAD) {
+        if(request->processGroup <= 0) currStatus.spreadCpu = nextSpreadCpu();
+        CPU_ZERO(&chosen.cpus);
+        CPU_SET(currStatus.spreadCpu, &chosen.cpus);
+        snprintf(chosen.cpuText, sizeof(chosen.cpuText), "%d", currStatus.spreadCpu);
+        chosen.set |= PLACE_CPUS;
+    }
+    describePlacement(&chosen, currStatus.placementText, sizeof(currStatus.placementText));
+    return &chosen;
+}
+
+// The cpu after the last one handed out, skipping the shell's first cpu.
+int nextSpreadCpu() {
+    cpu_set_t allowed;
+    int first = -1, count = 0;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return 0;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(!CPU_ISSET(cpu, &allowed)) continue;
+        if(first == -1) first = cpu;
+        count++;
+    }
+    // With a single cpu there is nothing to keep free.
+    if(count == 1) return first;
+
+    for(int step = 1; step <= CPU_SETSIZE; step++) {
+        int cpu = (currStatus.spreadCpu + step) % CPU_SETSIZE;
+        if(cpu != first && CPU_ISSET(cpu, &allowed)) return cpu;
+    }
+    return first;
+}
+
+void describePlacement(const struct placement *placement, char *text, size_t size) {
+    const char *ioNames[] = {"", "rt:", "be:", "idle"};
+    int length = 0;
+
+    text[0] = '\0';
+    if(placement->set & PLACE_CPUS) length += snprintf(text + length, size - length, "cpus=%s ", placement->cpuText);
+    else if(placement->set & PLACE_SPREAD) length += snprintf(text + length, size - length, "cpus=spread ");
+    if(placement->set & PLACE_NICE) length += snprintf(text + length, size - length, "nice=%d ", placement->nice);
+    if(placement->set & PLACE_CLASS) {
+        length += snprintf(text + length, size - length, "class=%s ", placement->policy == SCHED_BATCH ? "batch" :
+                           placement->policy == SCHED_IDLE ? "idle" : "normal");
+    }
+    if(placement->set & PLACE_IO) {
+        length += snprintf(text + length, size - length, "io=%s", ioNames[placement->ioClass]);
+        if(placement->ioClass != 3) length += snprintf(text + length, size - length, "%d", placement->ioLevel);
+        length += snprintf(text + length, size - length, " ");
+    }
+    if(length > 0 && (size_t)length <= size) text[length - 1] = '\0';
+}
+
+// Applies a placement to the calling process, run in a forked child.
+int applyPlacement(const struct placement *placement) {
+    if(placement == NULL) return 0;
+
+    if((placement->set & PLACE_CPUS) && sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus) == -1) return -1;
+    if((placement->set & PLACE_CLASS)) {
+        struct sched_param parameters = {0};
+        if(sched_setscheduler(0, placement->policy, &parameters) == -1) return -1;
+    }
+    if((placement->set & PLACE_NICE) && setpriority(PRIO_PROCESS, 0, placement->nice) == -1) return -1;
+    if((placement->set & PLACE_IO) &&
+       syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, placement->ioClass << IOPRIO_CLASS_SHIFT | placement->ioLevel) == -1) return -1;
+    return 0;
+}
+
+void schedCommand(struct command *cmd) {
+    struct stage *first = &cmd->stages[0];
+    struct placement placement = {0};
+    int words = 1;
+    int result = 1;
+
+    currStatus.lastStatus = 1;
+    if(first->argc == 1) {
+        char text[64];
+        describePlacement(&backgroundPlacement, text, sizeof(text));
+        printf("background: %s\n", backgroundPlacement.set == 0 ? "no policy" : text);
+        currStatus.lastStatus = 0;
+        return;
+    }
+    if(first->argc == 2 && strcmp(first->argv[1], "off") == 0) {
+        backgroundPlacement.set = 0;
+        currStatus.lastStatus = 0;
+        return;
+    }
+
+    for(; words < first->argc && (result = parsePlacement(first->argv[words], &placement)) == 0; words++);
+    if(result == -1) return;
+    if(words == 1) {
+        fprintf(stderr, "usage: sched [off | setting=value ... [command]]\n");
+        return;
+    }
+
+    if(words == first->argc) {
+        backgroundPlacement = placement;
+        currStatus.lastStatus = 0;
+        return;
+    }
+    first->argv += words;
+    first->argc -= words;
+    currStatus.placement = &placement;
+    activateCommands(cmd);
+    currStatus.placement = NULL;
+}
+
+// PIPELINES
+// Starts a command that isn't a builtin on the launch path that suits it.
+void dispatchJob(struct command *cmd, int type) {
+    struct stage *first = &cmd->stages[0];
+
+    if(cmd->stageCount > 1) {
+        runPipeline(cmd, type);
+    } else if(first->input == NULL && first->output == NULL) {
+        runProcess(cmd, type);
+    } else {
+        redirectProcess(cmd, type);
+    }
+}
+
+/* Stages are separated by |, e.g. ls -l | grep x | wc -l, and come from
+ * the lexer with their own argv and redirects. Every stage is started into
+ * one new process group and connected with close on exec pipes, so each
+ * child only keeps the two ends dup2'd onto its stdin and stdout. A
+ * foreground pipeline is given the terminal while it runs so ctrl-c
+ * reaches every stage. The status of a pipeline is the status of its last
+ * stage.
+ */
+void runPipeline(struct command *cmd, int type) {
+    pid_t *pids = arenaAlloc(&lineArena, cmd->stageCount * sizeof(pid_t));
+    int stages = 0;
+    int failed = 0;
+    int readEnd = -1;
+    pid_t processGroup = 0;
+
+    for(int i = 0; i < cmd->stageCount && !failed; i++) {
+        struct stage *stage = &cmd->stages[i];
+        int last = i == cmd->stageCount - 1;
+        struct launchRequest request = {stage->argv, -1, -1, type, processGroup};
+        int pipeFDs[2] = {-1, -1};
+
+        if(openRedirects(stage->input, stage->output, &request.inputFD, &request.outputFD) == -1) {
+            failed = 1;
+            break;
+        }
+        if(request.inputFD == -1) {
+            request.inputFD = readEnd;
+        } else if(readEnd != -1) {
+            close(readEnd);
+        }
+        readEnd = -1;
+
+        if(!last && request.outputFD == -1) {
+            if(pipe2(pipeFDs, O_CLOEXEC) == -1) {
+                perror("pipe2()");
+                currStatus.lastStatus = 1;
+                failed = 1;
+            } else {
+                if(currStatus.pipeSize > 0) fcntl(pipeFDs[1], F_SETPIPE_SZ, currStatus.pipeSize);
+                request.outputFD = pipeFDs[1];
+                readEnd = pipeFDs[0];
+            }
+        }
+
+        pid_t pid = failed ? -1 : startChild(&request);
+
+        if(request.inputFD != -1) close(request.inputFD);
+        if(request.outputFD != -1) close(request.outputFD);
+
+        if(pid == -1) {
+            failed = 1;
+            break;
+        }
+        pids[stages++] = pid;
+        if(processGroup == 0) {
+            processGroup = pid;
+            if(type == 0 && currStatus.interactive) tcsetpgrp(STDIN_FILENO, processGroup);
+        }
+    }
+    if(readEnd != -1) close(readEnd);
+
+    if(stages == 0) return;
+
+    // A stage could not be started, so the ones already running are stopped
+    // rather than left waiting on a pipe nobody will finish.
+    if(failed) {
+        int childStatus;
+        kill(-processGroup, SIGTERM);
+        for(int i = 0; i < stages; i++) waitChild(pids[i], &childStatus);
+    } else if(type == 0) {
+        int childStatus;
+        for(int i = 0; i < stages - 1; i++) waitChild(pids[i], &childStatus);
+        waitForeground(pids[stages - 1]);
+    } else {
+        startBackgroundJob(cmd, pids, stages);
+    }
+
+    if(type == 0 && currStatus.interactive) tcsetpgrp(STDIN_FILENO, currStatus.shellGroup);
+}
+
+// PARALLEL
+/* parallel [-j jobs] command [words] ::: inputs...
+ * parallel [-j jobs] command [words] :::: file
+ * parallel [-j jobs] command [words] < file
+ * Runs the command once per input. Every {} in a word is replaced by the
+ * input, and without a {} the input is added as the last word. Inputs are
+ * the words after :::, the lines of the file after :::: (- for standard
+ * input) or otherwise the lines of the < file or standard input, which are
+ * read as jobs run. At most jobs children run at once, one per online cpu
+ * by default, and the next one starts as soon as one is reaped. Each child
+ * writes into its own memfd, which is copied out in one piece when it
+ * finishes so the output of two jobs never interleaves.
+ */
+struct parallelInput {
+    char **words;
+    int count;
+    int next;
+    FILE *file;
+    char *line;
+    size_t capacity;
+};
+
+struct parallelSlot {
+    pid_t pid;
+    int outputFD;
+};
+
+// Returns the next input, or NULL once they run out. Blank lines are skipped.
+char *nextParallelInput(struct parallelInput *inputs) {
+    ssize_t length;
+
+    if(inputs->file == NULL) {
+        return inputs->next < inputs->count ? inputs->words[inputs->next++] : NULL;
+    }
+    while((length = getline(&inputs->line, &inputs->capacity, inputs->file)) != -1) {
+        if(length > 0 && inputs->line[length - 1] == '\n') inputs->line[--length] = '\0';
+        if(length > 0) return inputs->line;
+    }
+    return NULL;
+}
+
+/* Builds the argv for one input. The words are written into one buffer
+ * that is reused for every job, the launch engine has copied them into
+ * the child by the time the next job is built.
+ */
+void fillParallelArgv(char **words, int count, const char *input, char **argv, char **buffer, size_t *capacity) {
+    size_t inputLength = strlen(input);
+    size_t needed = inputLength + 1;
+    int placeholders = 0;
+    const char *at;
+    char *out;
+
+    for(int i = 0; i < count; i++) {
+        needed += strlen(words[i]) + 1;
+        for(at = strstr(words[i], "{}"); at != NULL; at = strstr(at + 2, "{}")) {
+            needed += inputLength;
+            placeholders++;
+        }
+    }
+    if(needed > *capacity) {
+        *capacity = needed * 2;
+        *buffer = realloc(*buffer, *capacity);
+    }
+
+    out = *buffer;
+    for(int i = 0; i < count; i++) {
+        const char *word = words[i];
+        argv[i] = out;
+        while((at = strstr(word, "{}")) != NULL) {
+            memcpy(out, word, at - word);
+            out += at - word;
+            memcpy(out, input, inputLength);
+            out += inputLength;
+            word = at + 2;
+        }
+        size_t rest = strlen(word) + 1;
+        memcpy(out, word, rest);
+        out += rest;
+    }
+    if(placeholders == 0) {
+        argv[count++] = out;
+        memcpy(out, input, inputLength + 1);
+    }
+    argv[count] = NULL;
+}
+
+// Copies a finished job's output to destination and closes it.
+void flushOutput(int outputFD, int destination) {
+    struct stat info;
+    off_t offset = 0;
+    char chunk[8192];
+
+    fflush(stdout);
+    if(fstat(outputFD, &info) == 0) {
+        while(offset < info.st_size) {
+            if(sendfile(destination, outputFD, &offset, info.st_size - offset) > 0) continue;
+
+            // sendfile refuses some outputs, such as files opened for append
+            ssize_t bytes = pread(outputFD, chunk, sizeof(chunk), offset);
+            if(bytes <= 0 || write(destination, chunk, bytes) != bytes) break;
+            offset += bytes;
+        }
+    }
+    close(outputFD);
+}
+
+void parallelCommand(struct stage *stage) {
+    struct parallelInput inputs = {NULL, 0, 0, NULL, NULL, 0};
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    int last;
+
+    if(first < stage->argc && strncmp(stage->argv[first], "-j", 2) == 0) {
+        char *value = stage->argv[first][2] != '\0' ? stage->argv[first] + 2 : stage->argv[++first];
+        char *end = NULL;
+        jobs = value != NULL ? strtol(value, &end, 10) : 0;
+        if(value == NULL || *end != '\0' || jobs < 1) {
+            fprintf(stderr, "parallel: -j needs a positive number\n");
+            currStatus.lastStatus = 1;
+            return;
+        }
+        first++;
+    }
+    if(jobs < 1) jobs = 1;
+
+    for(last = first; last < stage->argc; last++) {
+        if(strcmp(stage->argv[last], ":::") == 0 || strcmp(stage->argv[last], "::::") == 0) break;
+    }
+    if(last == first || (last < stage->argc && stage->argv[last][3] == ':' && last + 1 >= stage->argc)) {
+        fprintf(stderr, "usage: parallel [-j jobs] command [{}] [::: inputs | :::: file]\n");
+        currStatus.lastStatus = 1;
+        return;
+    }
+
+    const char *listName = NULL;
+    if(last == stage->argc) {
+        listName = stage->input;
+    } else if(stage->argv[last][3] == ':') {
+        listName = strcmp(stage->argv[last + 1], "-") == 0 ? NULL : stage->argv[last + 1];
+    } else {
+        inputs.words = &stage->argv[last + 1];
+        inputs.count = stage->argc - last - 1;
+    }
+    if(inputs.words == NULL) {
+        inputs.file = listName != NULL ? fopen(listName, "r") : stdin;
+        if(inputs.file == NULL) {
+            fprintf(stderr, "parallel: cannot open %s: %s\n", listName, strerror(errno));
+            currStatus.lastStatus = 1;
+            return;
+        }
+    }
+
+    // Jobs must not read the inputs that are still waiting on standard input.
+    int jobInput = inputs.file == stdin ? open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+    struct parallelSlot *slots = arenaAlloc(&lineArena, jobs * sizeof(struct parallelSlot));
+    char **argv = arenaAlloc(&lineArena, (last - first + 2) * sizeof(char *));
+    char *buffer = NULL;
+    size_t capacity = 0;
+    int running = 0;
+    int failed = 0;
+    int stopped = 0;
+    char *input;
+
+    while(1) {
+        while(!stopped && running < jobs && (input = nextParallelInput(&inputs)) != NULL) {
+            fillParallelArgv(&stage->argv[first], last - first, input, argv, &buffer, &capacity);
+
+            struct launchRequest request = {argv, jobInput, memfd_create("parallel", MFD_CLOEXEC), 0, -1};
+            pid_t pid = startChild(&request);
+            if(pid == -1) {
+                if(request.outputFD != -1) close(request.outputFD);
+                failed = 1;
+                continue;
+            }
+            slots[running].pid = pid;
+            slots[running].outputFD = request.outputFD;
+            running++;
+        }
+        if(running == 0) break;
+
+        int childStatus;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &childStatus, 0, &usage);
+        if(pid == -1) {
+            if(errno == EINTR) continue;
+            perror("wait4()");
+            break;
+        }
+
+        int slot = 0;
+        while(slot < running && slots[slot].pid != pid) slot++;
+        if(slot == running) {
+            // A background job finished while the pool was waiting.
+            reapChild(pid, childStatus, &usage);
+            continue;
+        }
+        addUsage(&currStatus.commandUsage, &usage);
+
+        if(slots[slot].outputFD != -1) flushOutput(slots[slot].outputFD, STDOUT_FILENO);
+        if(WIFSIGNALED(childStatus)) {
+            printf("pid %d terminated: signal %d\n", pid, WTERMSIG(childStatus));
+            failed = 1;
+            // ctrl-c stops the whole run, not just the jobs it hit
+            if(WTERMSIG(childStatus) == SIGINT) stopped = 1;
+        } else if(WEXITSTATUS(childStatus) != 0) {
+            failed = 1;
+        }
+        slots[slot] = slots[--running];
+    }
+
+    free(buffer);
+    free(inputs.line);
+    if(jobInput != -1) close(jobInput);
+    if(inputs.file == stdin) clearerr(stdin);
+    else if(inputs.file != NULL) fclose(inputs.file);
+    currStatus.lastStatus = failed;
+}
+
+// TRACING
+/* With SMALLSH_TRACE=/path set, the shell records a span for each step of
+ * a line: read-line, parse, dispatch, spawn or fork, wait and reap. Every
+ * background job also gets a span on a track of its own, from its launch
+ * until it is reaped. The file is in the Chrome trace event format, so
+ * chrome://tracing or Perfetto can open it.
+ *
+ * A span is two clock readings stored into a fixed buffer. The JSON is
+ * only formatted when the buffer fills up and when the shell exits. With
+ * tracing off, traceStart() returns 0 without reading the clock and
+ * traceEnd() returns straight away.
+ */
+#define TRACE_SPANS 4096
+
+struct traceSpan {
+    const char *name;
+    long long startNs;
+    long long endNs;
+    pid_t child;
+    int childTrack;
+};
+
+struct trace {
+    int fd;
+    int count;
+    long written;
+    struct traceSpan spans[TRACE_SPANS];
+};
+
+static struct trace trace = {-1, 0, 0};
+
+void openTrace() {
+    char *path = getenv("SMALLSH_TRACE");
+
+    if(path == NULL || *path == '\0') return;
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(trace.fd == -1) {
+        fprintf(stderr, "smallsh: cannot open trace %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if(write(trace.fd, "[", 1) != 1) return;
+    atexit(closeTrace);
+}
+
+long long traceStart() {
+    return trace.fd == -1 ? 0 : nowNs();
+}
+
+void addSpan(const char *name, long long startNs, pid_t child, int childTrack) {
+    struct traceSpan *span = &trace.spans[trace.count++];
+
+    span->name = name;
+    span->startNs = startNs;
+    span->endNs = nowNs();
+    span->child = child;
+    span->childTrack = childTrack;
+    if(trace.count == TRACE_SPANS) flushTrace();
+}
+
+// Ends a span begun with traceStart(). child is the pid it concerns, or 0.
+void traceEnd(const char *name, long long startNs, pid_t child) {
+    if(trace.fd != -1) addSpan(name, startNs, child, 0);
+}
+
+// The whole life of a background job, shown on the track of its last pid.
+void traceJob(long long startNs, pid_t child) {
+    if(trace.fd != -1) addSpan("job", startNs, child, 1);
+}
+
+// Formats the buffered spans as trace events and writes them out.
+void flushTrace() {
+    char out[1 << 16];
+    size_t used = 0;
+    pid_t shell = getpid();
+
+    for(int i = 0; i < trace.count; i++) {
+        struct traceSpan *span = &trace.spans[i];
+        long long duration = span->endNs - span->startNs;
+
+        used += snprintf(out + used, sizeof(out) - used,
+                         "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,\"pid\":%d,\"tid\":%d",
+                         trace.written++ == 0 ? "" : ",", span->name,
+                         span->startNs / 1000, span->startNs % 1000, duration / 1000, duration % 1000,
+                         shell, span->childTrack ? span->child : shell);
+        if(span->child > 0) used += snprintf(out + used, sizeof(out) - used, ",\"args\":{\"pid\":%d}", span->child);
+        out[used++] = '}';
+
+        if(used > sizeof(out) - 512 || i == trace.count - 1) {
+            if(write(trace.fd, out, used) != (ssize_t)used) break;
+            used = 0;
+        }
+    }
+    trace.count = 0;
+}
+
+/* Called in a fork of the shell. The spans it inherited are the parent's
+ * to write, and its own are left out.
+ */
+void forgetTrace() {
+    if(trace.fd != -1) close(trace.fd);
+    trace.fd = -1;
+    trace.count = 0;
+}
+
+// Writes what is left and closes the event array, run at exit.
+void closeTrace() {
+    if(trace.fd == -1) return;
+    flushTrace();
+    if(write(trace.fd, "\n]\n", 3) != 3) perror("trace");
+    close(trace.fd);
+    trace.fd = -1;
+}
+
+// EXECUTABLE LOOKUP CACHE
+/* execvp tries execve in every PATH directory until one works, which is
+ * several failed system calls per command on a long PATH. Instead the
+ * resolved path of each command name is kept in an open addressing hash
+ * table and the launch engine execs it directly. The table is emptied
+ * when PATH changes, and a single entry is dropped when its file can no
+ * longer be executed.
+ */
+struct pathEntry {
+    char *name;
+    char *path;
+    unsigned int hash;
+    long hits;
+};
+
+struct pathCache {
+    struct pathEntry *entries;
+    int capacity;
+    int count;
+    char *pathValue;
+};
+
+static struct pathCache commandCache = {NULL, 0, 0, NULL};
+
+// FNV-1a hash of a string.
+unsigned int hashString(const char *string) {
+    unsigned int hash = 2166136261u;
+
+    while(*string != '\0') {
+        hash ^= (unsigned char)*string++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Empty the cache, keeping the table itself for reuse.
+void clearCommandCache() {
+    for(int i = 0; i < commandCache.capacity; i++) {
+        if(commandCache.entries[i].name != NULL) {
+            free(commandCache.entries[i].name);
+            free(commandCache.entries[i].path);
+            commandCache.entries[i].name = NULL;
+        }
+    }
+    commandCache.count = 0;
+}
+
+/* Walks the directories in pathValue the same way execvp does and returns
+ * a newly allocated path to the first executable regular file, or NULL.
+ */
+char *searchPath(const char *name, const char *pathValue) {
+    size_t nameLength = strlen(name);
+    const char *dir = pathValue;
+
+    while(1) {
+        const char *end = strchr(dir, ':');
+        size_t dirLength = end == NULL ? strlen(dir) : (size_t)(end - dir);
+
+        // An empty PATH entry means the current directory.
+        char *candidate = malloc(dirLength + nameLength + 3);
+        if(dirLength == 0) {
+            sprintf(candidate, "./%s", name);
+        } else {
+            memcpy(candidate, dir, dirLength);
+            candidate[dirLength] = '/';
+            memcpy(candidate + dirLength + 1, name, nameLength + 1);
+        }
+
+        struct stat info;
+        if(access(candidate, X_OK) == 0 && stat(candidate, &info) == 0 && S_ISREG(info.st_mode)) {
+            return candidate;
+        }
+        free(candidate);
+
+        if(end == NULL) return NULL;
+        dir = end + 1;
+    }
+}
+
+// Adds a resolved path to the table, growing it when it is 3/4 full.
+void insertCommandPath(const char *name, char *path) {
+    if((commandCache.count + 1) * 4 > commandCache.capacity * 3) {
+        struct pathEntry *old = commandCache.entries;
+        int oldCapacity = commandCache.capacity;
+
+        commandCache.capacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+        commandCache.entries = calloc(commandCache.capacity, sizeof(struct pathEntry));
+        for(int i = 0; i < oldCapacity; i++) {
+            if(old[i].name == NULL) continue;
+            int slot = old[i].hash & (commandCache.capacity - 1);
+            while(commandCache.entries[slot].name != NULL) slot = (slot + 1) & (commandCache.capacity - 1);
+            commandCache.entries[slot] = old[i];
+        }
+        free(old);
+    }
+
+    unsigned int hash = hashString(name);
+    int slot = hash & (commandCache.capacity - 1);
+    while(commandCache.entries[slot].name != NULL) slot = (slot + 1) & (commandCache.capacity - 1);
+
+    commandCache.entries[slot].name = strdup(name);
+    commandCache.entries[slot].path = path;
+    commandCache.entries[slot].hash = hash;
+    commandCache.entries[slot].hits = 0;
+    commandCache.count++;
+}
+
+/* Removes one name from the table. Later entries in the same probe run are
+ * shifted back so lookups never stop early at the hole.
+ */
+void forgetCommand(const char *name) {
+    if(commandCache.capacity == 0) return;
+
+    int mask = commandCache.capacity - 1;
+    int slot = hashString(name) & mask;
+
+    while(commandCache.entries[slot].name != NULL && strcmp(commandCache.entries[slot].name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    if(commandCache.entries[slot].name == NULL) return;
+
+    free(commandCache.entries[slot].name);
+    free(commandCache.entries[slot].path);
+    commandCache.entries[slot].name = NULL;
+    commandCache.count--;
+
+    int next = (slot + 1) & mask;
+    while(commandCache.entries[next].name != NULL) {
+        int home = commandCache.entries[next].hash & mask;
+        // Move the entry into the hole if the hole lies between its home
+        // slot and where it sits now.
+        if(((next - home) & mask) >= ((next - slot) & mask)) {
+            commandCache.entries[slot] = commandCache.entries[next];
+            commandCache.entries[next].name = NULL;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+/* Returns the path to execute for a command name, or NULL if it isn't on
+ * PATH. Names with a / in them are used as they are.
+ */
+const char *resolveCommand(const char *name) {
+    if(strchr(name, '/') != NULL) return name;
+
+    // glibc's default when PATH is unset.
+    const char *pathValue = getenv("PATH");
+    if(pathValue == NULL) pathValue = "/bin:/usr/bin";
+
+    if(commandCache.pathValue == NULL || strcmp(commandCache.pathValue, pathValue) != 0) {
+        clearCommandCache();
+        free(commandCache.pathValue);
+        commandCache.pathValue = strdup(pathValue);
+    }
+
+    if(commandCache.capacity > 0) {
+        int mask = commandCache.capacity - 1;
+        int slot = hashString(name) & mask;
+        while(commandCache.entries[slot].name != NULL) {
+            if(strcmp(commandCache.entries[slot].name, name) == 0) {
+                commandCache.entries[slot].hits++;
+                return commandCache.entries[slot].path;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    char *path = searchPath(name, pathValue);
+    if(path == NULL) return NULL;
+    insertCommandPath(name, path);
+    return path;
+}
+
+/* The hash command.
+ * hash         -> lists the cached commands with their hit counts
+ * hash -r      -> empties the cache
+ * hash name... -> looks the names up now so later launches skip PATH
+ */
+void hashCommand(struct stage *stage) {
+    currStatus.lastStatus = 0;
+
+    if(stage->argc == 1) {
+        if(commandCache.count == 0) {
+            printf("hash: hash table empty\n");
+            return;
+        }
+        printf("hits\tcommand\n");
+        for(int i = 0; i < commandCache.capacity; i++) {
+            if(commandCache.entries[i].name != NULL) {
+                printf("%4ld\t%s\n", commandCache.entries[i].hits, commandCache.entries[i].path);
+            }
+        }
+        return;
+    }
+
+    if(strcmp(stage->argv[1], "-r") == 0) {
+        clearCommandCache();
+        return;
+    }
+
+    for(int i = 1; i < stage->argc; i++) {
+        if(strchr(stage->argv[i], '/') != NULL) continue;
+        if(resolveCommand(stage->argv[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", stage->argv[i]);
+            currStatus.lastStatus = 1;
+        }
+    }
+}
+
+// JOB TABLE
+/* Background jobs live in a table that grows as needed, so there is no
+ * limit on how many can run. Each job remembers every pid in it, and a
+ * hash map from pid to table slot finds the job of a finished child in
+ * constant time. A slot goes back on the free list as soon as the last
+ * process of its job is reaped.
+ */
+struct job {
+    int id;
+    pid_t *pids;
+    int pidCount;
+    int remaining;
+    int status;
+    char *commandLine;
+    char *placement;    // where its processes run, or NULL
+    struct jobUsage usage;
+    struct jobLimits limits;
+    int client;         // server connection waiting on the job, or -1
+    int sequence;
+    int outputFD;
+};
 
-    SIGINT_action.sa_flags = SA_RESTART;
+struct jobTable {
+    struct job *jobs;
+    int capacity;
+    int count;
+    int *freeSlots;
+    int freeCount;
+    pid_t *pidKeys;
+    int *pidSlots;
+    int pidCapacity;
+    int pidCount;
+    int atPrompt;   // a prompt is on screen while jobs are reported
+    int quiet;      // the server starts jobs without announcing them
+    int lastAdded;
+    long finished;
+};
 
-    // Handles toggling of foreground only mode.
-    SIGINT_action.sa_handler = toggleForegroundMode;
-    sigaction(SIGTSTP, &SIGINT_action, NULL);
+static struct jobTable jobTable;
 
-    // I use the same command for both background and foreground redirects
-    // So I pass a flag variable 1 or 0 that denotes whether the command
-    // is a foreground 0 or background 1 process.
-    if(type == 0) {
-        // Allows foreground process to be terminated with ctrl-c
-        SIGINT_action.sa_handler = handleSignals;
-        sigaction(SIGINT, &SIGINT_action, NULL);
-    } else {
-        // ignores ctrl-c
-        SIGINT_action.sa_handler = SIG_IGN;
-        sigaction(SIGINT, &SIGINT_action, NULL);
+/* With SMALLSH_MAX_JOBS or queue N set, at most N background jobs run at
+ * once. A background command over the limit is copied out of the line's
+ * arena into a FIFO and started once a running job has been reaped, with
+ * the limit and sched prefixes it was given. Jobs sent to the server wait
+ * in the same queue and keep their client.
+ */
+struct queuedJob {
+    struct command *cmd;
+    int hasLimits;
+    struct jobLimits limits;
+    int hasPlacement;
+    struct placement placement;
+    int client;
+    int sequence;
+    int outputFD;
+    struct queuedJob *next;
+};
+
+struct backgroundQueue {
+    struct queuedJob *head;
+    struct queuedJob *tail;
+    int count;
+    struct queuedJob *lastQueued;   // so the server can claim what it queued
+};
+
+static struct backgroundQueue backgroundQueue = {NULL, NULL, 0, NULL};
+
+// Spreads pids across the map, consecutive pids are common.
+unsigned int hashPid(pid_t pid) {
+    return (unsigned int)pid * 2654435761u;
+}
+
+// Returns the table slot of the job that owns pid, or -1.
+int findJobSlot(pid_t pid) {
+    if(jobTable.pidCapacity == 0) return -1;
+
+    int mask = jobTable.pidCapacity - 1;
+    int slot = hashPid(pid) & mask;
+
+    while(jobTable.pidKeys[slot] != 0) {
+        if(jobTable.pidKeys[slot] == pid) return jobTable.pidSlots[slot];
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Records that pid belongs to the job in jobSlot, growing the map at half full.
+void mapPid(pid_t pid, int jobSlot) {
+    if((jobTable.pidCount + 1) * 2 > jobTable.pidCapacity) {
+        pid_t *oldKeys = jobTable.pidKeys;
+        int *oldSlots = jobTable.pidSlots;
+        int oldCapacity = jobTable.pidCapacity;
+
+        jobTable.pidCapacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+        jobTable.pidKeys = calloc(jobTable.pidCapacity, sizeof(pid_t));
+        jobTable.pidSlots = calloc(jobTable.pidCapacity, sizeof(int));
+        jobTable.pidCount = 0;
+        for(int i = 0; i < oldCapacity; i++) {
+            if(oldKeys[i] != 0) mapPid(oldKeys[i], oldSlots[i]);
+        }
+        free(oldKeys);
+        free(oldSlots);
+    }
+
+    int mask = jobTable.pidCapacity - 1;
+    int slot = hashPid(pid) & mask;
+    while(jobTable.pidKeys[slot] != 0) slot = (slot + 1) & mask;
+
+    jobTable.pidKeys[slot] = pid;
+    jobTable.pidSlots[slot] = jobSlot;
+    jobTable.pidCount++;
+}
+
+// Removes pid from the map, shifting later entries back into the hole.
+void unmapPid(pid_t pid) {
+    int mask = jobTable.pidCapacity - 1;
+    int slot = hashPid(pid) & mask;
+
+    while(jobTable.pidKeys[slot] != pid) {
+        if(jobTable.pidKeys[slot] == 0) return;
+        slot = (slot + 1) & mask;
+    }
+    jobTable.pidKeys[slot] = 0;
+    jobTable.pidCount--;
+
+    int next = (slot + 1) & mask;
+    while(jobTable.pidKeys[next] != 0) {
+        int home = hashPid(jobTable.pidKeys[next]) & mask;
+        if(((next - home) & mask) >= ((next - slot) & mask)) {
+            jobTable.pidKeys[slot] = jobTable.pidKeys[next];
+            jobTable.pidSlots[slot] = jobTable.pidSlots[next];
+            jobTable.pidKeys[next] = 0;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+/* Rebuilds the command text of a line for the jobs listing and status,
+ * through cmd->listEnd when the command starts a list.
+ */
+char *describeCommand(struct command *cmd) {
+    struct command *last = cmd->listEnd != NULL ? cmd->listEnd : cmd;
+    size_t length = 1;
+
+    for(struct command *part = cmd; ; part = part->next) {
+        for(int i = 0; i < part->stageCount; i++) {
+            struct stage *stage = &part->stages[i];
+            for(int j = 0; j < stage->argc; j++) length += strlen(stage->argv[j]) + 1;
+            if(stage->input != NULL) length += strlen(stage->input) + 3;
+            if(stage->output != NULL) length += strlen(stage->output) + 3;
+            length += 2;
+        }
+        length += 5;
+        if(part == last) break;
+    }
+
+    char *text = malloc(length);
+    char *end = text;
+    for(struct command *part = cmd, *previous = NULL; ; previous = part, part = part->next) {
+        // A part after & needs no separator of its own.
+        if(previous != NULL) {
+            if(part->connector == LIST_AND) end += sprintf(end, "&& ");
+            else if(part->connector == LIST_OR) end += sprintf(end, "|| ");
+            else if(!previous->background) end += sprintf(end, "; ");
+        }
+
+        for(int i = 0; i < part->stageCount; i++) {
+            struct stage *stage = &part->stages[i];
+            if(i > 0) end += sprintf(end, "| ");
+            for(int j = 0; j < stage->argc; j++) end += sprintf(end, "%s ", stage->argv[j]);
+            if(stage->input != NULL) end += sprintf(end, "< %s ", stage->input);
+            if(stage->output != NULL) end += sprintf(end, "> %s ", stage->output);
+        }
+        if(part->background) end += sprintf(end, "& ");
+        if(part == last) break;
+    }
+    end[-1] = '\0';
+    return text;
+}
+
+// Adds a job for the given pids and returns its slot.
+int addJob(struct command *cmd, pid_t *pids, int count) {
+    if(jobTable.freeCount == 0) {
+        int oldCapacity = jobTable.capacity;
+
+        jobTable.capacity = oldCapacity == 0 ? 16 : oldCapacity * 2;
+        jobTable.jobs = realloc(jobTable.jobs, jobTable.capacity * sizeof(struct job));
+        jobTable.freeSlots = realloc(jobTable.freeSlots, jobTable.capacity * sizeof(int));
+        // Pushed in reverse so the lowest free slot is handed out first.
+        for(int i = jobTable.capacity - 1; i >= oldCapacity; i--) {
+            jobTable.jobs[i].id = 0;
+            jobTable.freeSlots[jobTable.freeCount++] = i;
+        }
     }
 
-    // First I harvest the commands. I ignore any < or > characters as well as the
-    // background & (we already know it's a background command by the flag).
-    // These commands are added to a list for input into the execute variable
-    while(currList != NULL) {
-        if (strcmp(currList->command, "<") == 0 || strcmp(currList->command, ">") == 0) {
-            currList = currList->next;
+    int slot = jobTable.freeSlots[--jobTable.freeCount];
+    struct job *job = &jobTable.jobs[slot];
+
+    job->id = slot + 1;
+    job->pids = malloc(count * sizeof(pid_t));
+    memcpy(job->pids, pids, count * sizeof(pid_t));
+    job->pidCount = count;
+    job->remaining = count;
+    job->status = 0;
+    job->commandLine = describeCommand(cmd);
+    job->placement = currStatus.placementText[0] == '\0' ? NULL : strdup(currStatus.placementText);
+    startUsage(&job->usage);
+    job->limits.set = 0;
+    if(currStatus.limits != NULL) job->limits = *currStatus.limits;
+    job->client = -1;
+    job->sequence = 0;
+    job->outputFD = -1;
+    for(int i = 0; i < count; i++) mapPid(pids[i], slot);
+    jobTable.count++;
+    jobTable.lastAdded = slot;
+    return slot;
+}
+
+// Prints how a finished job ended and frees its slot.
+void finishJob(int slot) {
+    struct job *job = &jobTable.jobs[slot];
+    pid_t pid = job->pids[job->pidCount - 1];
+
+    currStatus.lastLimit = limitReason(job->status, &job->limits, &job->usage.rusage);
+
+    // A job started for a server connection is reported to the client.
+    if(job->client != -1) {
+        serverJobDone(slot);
+    } else {
+        // Move off the prompt line before the first message printed under it.
+        if(jobTable.atPrompt) {
+            printf("\n");
+            jobTable.atPrompt = 0;
+        }
+        if(currStatus.lastLimit != NULL) {
+            printf("background pid %d terminated: signal %d (%s)\n", pid, WTERMSIG(job->status), currStatus.lastLimit);
+        } else if(WIFSIGNALED(job->status)) {
+            printf("background pid %d terminated: signal %d\n", pid, WTERMSIG(job->status));
         } else {
-            if(currList->next != NULL) {
-                commands[i] = calloc(strlen(list->command) + 1, sizeof(char));
-                sprintf(commands[i], "%s", list->command);
-                i++;
-            } else {
-                if(strcmp(currList->command, "&") != 0) {
-                    commands[i] = calloc(strlen(list->command) + 1, sizeof(char));
-                    sprintf(commands[i], "%s", list->command);
-                    i++;
-                }
-            }
+            printf("background pid %d is done: exit value %d\n", pid, WEXITSTATUS(job->status));
         }
-        currList = currList->next;
-    }
-    // This is for an edge case where the first time I input a command, it fails because
-    // it thinks there is a file for a blank space.
-    commands[i] = NULL;
-
-    // This will search the list for any instance of <. It will trigger the flags to let
-    // the program know to start a input file redirect. It will also put the file handle 
-    // into a variable if it exists. Otherwise when the program is run it will reference
-    // /dev/null
-    currList = list;
-    // Assign the input file for processing to input and trigger the flag that input was found
-    while(currList != NULL) {
-        if(strcmp(currList->command, "<") == 0) {
-            hasInput = 1;
-            if(currList->next != NULL && strcmp(currList->command, ">") != 0) {
-                currList = currList->next;
-                inputFlag = 1;
-                input = calloc(strlen(currList->command) + 1, sizeof(char));
-                sprintf(input, "%s", currList->command);
-                break;
+    }
+
+    traceJob(job->usage.startNs, pid);
+    recordUsage(&job->usage, job->commandLine);
+    free(job->placement);
+    free(job->pids);
+    job->id = 0;
+    jobTable.freeSlots[jobTable.freeCount++] = slot;
+    jobTable.count--;
+    jobTable.finished++;
+}
+
+/* Records a reaped child. The job keeps the status of its last process
+ * and is finished once every process in it has been reaped. Returns the
+ * slot of the job, or -1 if the pid is not a background job.
+ */
+int reapChild(pid_t pid, int childStatus, const struct rusage *usage) {
+    long long started = traceStart();
+    int slot = findJobSlot(pid);
+    if(slot == -1) return -1;
+
+    struct job *job = &jobTable.jobs[slot];
+    unmapPid(pid);
+    addUsage(&job->usage, usage);
+    if(pid == job->pids[job->pidCount - 1]) job->status = childStatus;
+    if(--job->remaining == 0) finishJob(slot);
+    traceEnd("reap", started, pid);
+    return slot;
+}
+
+// Announces a new background job and starts tracking it.
+void startBackgroundJob(struct command *cmd, pid_t *pids, int count) {
+    char backgroundMessage[64];
+    int length = snprintf(backgroundMessage, sizeof(backgroundMessage),
+                          "Starting Background Process for id: %d\n", pids[count - 1]);
+
+    if(!jobTable.quiet) write(STDOUT_FILENO, backgroundMessage, length);
+    currStatus.lastBackground = pids[count - 1];
+    addJob(cmd, pids, count);
+}
+
+/* SIGCHLD is blocked and read from a signalfd instead of being handled.
+ * The prompt polls it next to stdin, so a job is reaped and reported the
+ * moment it exits rather than when the next line is entered. Children
+ * get an empty signal mask when they start.
+ */
+void watchChildren() {
+    sigset_t childSignal;
+
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, NULL);
+    currStatus.childEvents = signalfd(-1, &childSignal, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/* Reaps every background process that has finished and returns how many
+ * jobs completed. Nothing is done unless a SIGCHLD has arrived, and then
+ * wait4(-1) only returns children that have exited, so the cost follows
+ * the number of finished jobs and not the number running.
+ */
+int checkPid() {
+    struct signalfd_siginfo events[16];
+    struct rusage usage;
+    int childStatus;
+    long before = jobTable.finished;
+    int signalled = currStatus.childEvents == -1;
+    pid_t pid;
+
+    // Any number of exits can be folded into one pending signal.
+    while(currStatus.childEvents != -1 && read(currStatus.childEvents, events, sizeof(events)) > 0) signalled = 1;
+
+    if(!signalled || jobTable.count == 0) return 0;
+    while((pid = wait4(-1, &childStatus, WNOHANG, &usage)) > 0) reapChild(pid, childStatus, &usage);
+    startQueuedJobs();
+    return jobTable.finished - before;
+}
+
+/* Blocks until there is input on the terminal. Background jobs that finish
+ * while the prompt is waiting are reported straight away and the prompt is
+ * printed again under the messages. Returns 0 once there is input, or 1
+ * right after reporting, so the line editor can redraw what was typed
+ * before it waits again.
+ */
+int waitForInput() {
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {currStatus.childEvents, POLLIN, 0}};
+    int count = currStatus.childEvents == -1 ? 1 : 2;
+
+    while(1) {
+        if(poll(fds, count, -1) == -1) {
+            if(errno == EINTR) continue;
+            return 0;
+        }
+        if(fds[0].revents != 0) return 0;
+        if(fds[1].revents & POLLIN) {
+            jobTable.atPrompt = 1;
+            int finished = checkPid();
+            jobTable.atPrompt = 0;
+            if(finished > 0) {
+                printf(":");
+                fflush(stdout);
+                return 1;
             }
         }
-        currList = currList->next;
     }
+}
 
-    // This will search the list for any instance of >. It will trigger the flags to let
-    // the program know to start a output file redirect. It will also put the file handle 
-    // into a variable if it exists. Otherwise when the program is run it will reference
-    // /dev/null
-    currList = list;
-    // Assign the output file for processing to output and trigger the flag that output was found
-    while(currList != NULL) {
-        if(strcmp(currList->command, ">") == 0) {
-            hasOutput = 1;
-            if(currList->next != NULL && strcmp(currList->command, "<") != 0) {
-                currList = currList->next;
-                outputFlag = 1;
-                output = calloc(strlen(currList->command) + 1, sizeof(char));
-                sprintf(output, "%s", currList->command);
-                break;
-            }
-       }
-       currList = currList->next;
+// Returns the slot of a job given as %number or by one of its pids, or -1.
+int findJob(const char *target) {
+    if(target[0] == '%') {
+        int id = atoi(target + 1);
+        if(id > 0 && id <= jobTable.capacity && jobTable.jobs[id - 1].id != 0) return id - 1;
+        return -1;
+    }
+    return findJobSlot(atoi(target));
+}
+
+// Sends signal to every process of a job that hasn't been reaped yet.
+void signalJob(int slot, int signal) {
+    struct job *job = &jobTable.jobs[slot];
+
+    for(int i = 0; i < job->pidCount; i++) {
+        if(findJobSlot(job->pids[i]) == slot) kill(job->pids[i], signal);
+    }
+}
+
+// Lists the running background jobs.
+void listJobs() {
+    for(int i = 0; i < jobTable.capacity; i++) {
+        struct job *job = &jobTable.jobs[i];
+        if(job->id == 0) continue;
+        printf("[%d] %d running  %s", job->id, job->pids[job->pidCount - 1], job->commandLine);
+        if(job->placement != NULL) printf("  (%s)", job->placement);
+        printf("\n");
     }
+    for(struct queuedJob *entry = backgroundQueue.head; entry != NULL; entry = entry->next) {
+        char *commandLine = describeCommand(entry->cmd);
+        printf("[-] queued   %s\n", commandLine);
+        free(commandLine);
+    }
+    currStatus.lastStatus = 0;
+}
 
+/* The wait command.
+ * wait         -> waits for every background job to finish
+ * wait pid     -> waits for the job with that pid
+ * wait %n      -> waits for job number n
+ */
+void waitCommand(struct stage *stage) {
+    struct rusage usage;
     int childStatus;
-    pid_t childID = fork();
-    switch(childID){
-        case -1:
-            currStatus.lastStatus = -1;
-            perror("fork() error: \n");
-            break;
-        case 0:
-            // If we have an input file and output file with both redirect flags
-            if(inputFlag == 1 && outputFlag == 1) {
-
-                // Open source file
-                int sourceFD = open(input, O_RDONLY);
-                if(sourceFD == - 1) {
-                    perror("source open() \n");
-                    exit(1);
-                }
 
-                // redirect stdin to source file
-                int result = dup2(sourceFD, 0);
-                if(result == -1) {
-                    perror("source dup2()");
-                    exit(1);
-                }
+    if(stage->argc == 1) {
+        while(jobTable.count > 0) {
+            pid_t pid = wait4(-1, &childStatus, 0, &usage);
+            if(pid == -1 && errno == EINTR) continue;
+            if(pid == -1) break;
+            reapChild(pid, childStatus, &usage);
+            startQueuedJobs();
+        }
+        currStatus.lastStatus = 0;
+        return;
+    }
 
-                // open target file
-                int targetFD = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if(targetFD == -1) {
-                    perror("target open()");
-                    exit(1);
-                }
+    currStatus.lastStatus = 0;
+    for(int i = 1; i < stage->argc; i++) {
+        char *target = stage->argv[i];
+        int slot = findJob(target);
 
-                // Redirect standard out to target file
-                result = dup2(targetFD, 1);
-                if(result == -1){
-                    perror("target dup2()");
-                    exit(1);
-                }
+        if(slot == -1) {
+            fprintf(stderr, "wait: %s: no such job\n", target);
+            currStatus.lastStatus = 1;
+            continue;
+        }
 
-                // Executes command on the target files.
-                // Set file controls to close files when execution
-                // is finished
-                fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
-                fcntl(targetFD, F_SETFD, FD_CLOEXEC);
-                execvp(commands[0], commands);
-                perror("execv");
-                exit(1);
-                break;
-            // If we only have an input flag and input source
-            } else if(inputFlag == 1 && outputFlag == 0 && hasOutput == 0) {
-                
-                // Open source file
-                int sourceFD = open(input, O_RDONLY);
-                if(sourceFD == -1) {
-                    perror("source open(): ");
-                    exit(1);
+        // Wait for each process of the job that hasn't been reaped yet.
+        struct job *job = &jobTable.jobs[slot];
+        int id = job->id;
+        while(job->id == id) {
+            pid_t member = -1;
+            for(int j = 0; j < job->pidCount; j++) {
+                if(findJobSlot(job->pids[j]) == slot) {
+                    member = job->pids[j];
+                    break;
                 }
-                // Change stdout to command line
-                int result = dup2(sourceFD, 0);
-                if(result == -1){
-                    perror("dup2 error on source: ");
-                    exit(1);
-                }
-                // Close file on finish of execution
-                fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
-                execvp(commands[0], commands);
-                perror("execv");
-                exit(1);
-                break;
+            }
+            if(member == -1 || wait4(member, &childStatus, 0, &usage) == -1) break;
+            if(member == job->pids[job->pidCount - 1]) {
+                currStatus.lastStatus = WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == 0 ? 0 : 1;
+            }
+            reapChild(member, childStatus, &usage);
+        }
+    }
+    startQueuedJobs();
+}
 
-            // Has an output flag and file, but no input flag or file
-            } else if(inputFlag == 0 && outputFlag == 1 && hasInput == 0) {
-                
-                // open target file
-                int targetFD = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if(targetFD == -1) {
-                    perror("target open()");
-                    exit(1);
-                }
+// SERVING COMMANDS
+/* smallsh --serve path listens on a UNIX socket. A connection sends
+ * command lines, one per line, and each line runs as a background job in
+ * the same job table the prompt uses, so lines from any number of clients
+ * run at once. A single epoll loop waits on the listening socket, the
+ * clients and the SIGCHLD signalfd. When a job finishes its client gets
+ *
+ *   n exit status
+ *
+ * where n counts the lines sent on that connection from 1 and status is
+ * the exit value, or 128 plus the signal that ended it. Replies come in
+ * the order jobs finish. Starting a line with "capture " also sends what
+ * the command wrote to stdout and stderr before the status:
+ *
+ *   n output bytes
+ *   ...that many bytes...
+ *
+ * The output is kept in a memfd until then, as parallel does. Without
+ * capture it goes to /dev/null. echo, test and the other in-shell
+ * builtins answer straight away, and builtins that change the shell
+ * itself (cd, exit, export and the rest) are not available.
+ */
+struct client {
+    int fd;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    int sequence;
+    int running;    // jobs that still owe a reply
+    int open;       // lines can still arrive
+};
 
-                // Redirect output into target file
-                int result = dup2(targetFD, 1);
-                if(result == -1){
-                    perror("target dup2()");
-                    exit(1);
-                }
+// Clients are indexed by their descriptor, which stays open until the
+// last reply has gone out.
+struct server {
+    int listenFD;
+    int stopFD;
+    int epollFD;
+    int nullFD;
+    struct client *clients;
+    int capacity;
+};
 
-                // Close file on completion of execution
-                fcntl(targetFD, F_SETFD, FD_CLOEXEC);
-                execvp(commands[0], commands);
-                perror("execv");
-                exit(1);
-                break;
+static struct server server = {-1, -1, -1, -1, NULL, 0};
 
-            // If there is a redirection input and output flag but no files. Everything is
-            // routed to /dev/null
-            } else if(inputFlag == 0 && outputFlag == 0 && hasInput == 1 && hasOutput == 1) {
-                
-                // Open /dev/null as source
-                int sourceFD = open("/dev/null", O_RDONLY);
-                if(sourceFD == -1) {
-                    perror("source open(): ");
-                    exit(1);
-                }
-                // Redirect stdin to /dev/null
-                int result = dup2(sourceFD, 0);
-                if(result == -1){
-                    perror("dup2 error on source: ");
-                    exit(1);
-                }
-                
-                // open destination as /dev/null
-                int targetFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if(targetFD == -1) {
-                    perror("target open()");
-                    exit(1);
-                }
+int serveCommands(const char *path) {
+    struct epoll_event events[64];
+    struct epoll_event event = {EPOLLIN, {0}};
+    sigset_t signals;
 
-                // Redirect output to /dev/null
-                result = dup2(targetFD, 1);
-                if(result == -1){
-                    perror("target dup2()");
-                    exit(1);
-                }   
-
-                //Close upon execution
-                fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
-                fcntl(targetFD, F_SETFD, FD_CLOEXEC);
-                execvp(commands[0], commands);
-                perror("execv");
-                exit(1);
-                break;
+    initShell();
+    jobTable.quiet = 1;
 
-            // Source flag only, no input file
-            } else if(inputFlag == 0 && outputFlag == 0 && hasInput == 1 && hasOutput == 0) {
-                
-                // open /dev/null as source
-                int sourceFD = open("/dev/null", O_RDONLY);
-                if(sourceFD == -1) {
-                    perror("source open(): ");
-                    exit(1);
-                }
-                // Redirec standard input to /dev/null
-                int result = dup2(sourceFD, 0);
-                if(result == -1){
-                    perror("dup2 error on source: ");
-                    exit(1);
-                }
-                // Close files upon execution
-                fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
-                execvp(commands[0], commands);
-                perror("execv");
-                exit(1);
-                break;
-            // Output flag only, and no target file
-            } else if(inputFlag == 0 && outputFlag == 0 && hasInput == 0 && hasOutput == 1) {
-
-                // open target file as /dev/null
-                int targetFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if(targetFD == -1) {
-                    perror("target open()");
-                    exit(1);
-                }
+    // SIGPIPE is blocked so a client that has gone away only fails the
+    // write. ctrl-c and SIGTERM arrive on a signalfd so the socket can be
+    // removed on the way out.
+    signal(SIGINT, SIG_DFL);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    server.stopFD = signalfd(-1, &signals, SFD_CLOEXEC);
 
-                // Redirect stdout to /dev/null
-                int result = dup2(targetFD, 1);
-                if(result == -1){
-                    perror("target dup2()");
-                    exit(1);
-                }
-                // Close upon execution
-                fcntl(targetFD, F_SETFD, FD_CLOEXEC);
-                execvp(commands[0], commands);
-                perror("execv");
-                exit(1);
-                break;
+    // Jobs never read the daemon's own stdin.
+    server.nullFD = open("/dev/null", O_RDWR | O_CLOEXEC);
+    dup2(server.nullFD, STDIN_FILENO);
+
+    if(openServerSocket(path) == -1) return 1;
+
+    server.epollFD = epoll_create1(EPOLL_CLOEXEC);
+    event.data.fd = server.listenFD;
+    epoll_ctl(server.epollFD, EPOLL_CTL_ADD, server.listenFD, &event);
+    event.data.fd = server.stopFD;
+    epoll_ctl(server.epollFD, EPOLL_CTL_ADD, server.stopFD, &event);
+    event.data.fd = currStatus.childEvents;
+    epoll_ctl(server.epollFD, EPOLL_CTL_ADD, currStatus.childEvents, &event);
+
+    while(1) {
+        int count = epoll_wait(server.epollFD, events, sizeof(events) / sizeof(events[0]), -1);
+        if(count == -1) {
+            if(errno == EINTR) continue;
+            perror("epoll_wait()");
+            break;
+        }
+
+        for(int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if(fd == server.stopFD) {
+                unlink(path);
+                return 0;
+            } else if(fd == server.listenFD) {
+                acceptClients();
+            } else if(fd == currStatus.childEvents) {
+                checkPid();
+            } else {
+                readClient(fd);
             }
+        }
+        arenaReset(&lineArena);
+    }
+    unlink(path);
+    return 1;
+}
 
-        default:
-            // Restore signal handler to SIG_IGN upon child exit.
-            SIGINT_action.sa_handler = SIG_IGN;
-            sigaction(SIGINT, &SIGINT_action, NULL);
-            fflush(stdin);
-            fflush(stdout);
-            // Signals if a child process has been terminated to command line.
-            // Otherwise performs the child process as a foreground process.
-            if(type == 0) {
-                childID = waitpid(childID, &childStatus, 0);
-                if (WIFSIGNALED(childStatus)) {
-                    printf("pid %d terminated: signal %d\n", childID, childStatus);
-                }
-                currStatus.lastStatus = WEXITSTATUS(childStatus) == 0 ? 0 : 1;
-                cleanMemoryAndReturnToShell(list);
-            fflush(stdout);
-            fflush(stdin);
-            // Adds child pid the background pid tracking list
-            } else if(type == 1) {
-                char *backgroundMessage = calloc(47, sizeof(char));
-                sprintf(backgroundMessage, "Starting Background Process for id: %d\n", childID);
-                write(STDOUT_FILENO, backgroundMessage, 47);
-                fflush(stdout);
-                free(backgroundMessage);
-                addPidToBackgroundList(childID);
-                cleanMemoryAndReturnToShell(list);
-                break;
-            } 
+/* Binds and listens on path. A socket file left behind by a server that
+ * is no longer running is replaced. Returns -1 after reporting an error.
+ */
+int openServerSocket(const char *path) {
+    struct sockaddr_un address = {0};
+
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "smallsh: socket path too long: %s\n", path);
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    server.listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(server.listenFD == -1) {
+        perror("socket()");
+        return -1;
+    }
+
+    int result = bind(server.listenFD, (struct sockaddr *)&address, sizeof(address));
+    if(result == -1 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int alive = connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        close(probe);
+        if(alive) {
+            fprintf(stderr, "smallsh: %s is already being served\n", path);
+            return -1;
+        }
+        unlink(path);
+        result = bind(server.listenFD, (struct sockaddr *)&address, sizeof(address));
+    }
+    if(result == -1 || listen(server.listenFD, SOMAXCONN) == -1) {
+        fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void acceptClients() {
+    struct epoll_event event = {EPOLLIN, {0}};
+    // Replies are written blocking, a client that stops reading for this
+    // long loses them rather than holding up everyone else.
+    struct timeval timeout = {5, 0};
+    int fd;
+
+    while((fd = accept4(server.listenFD, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+        if(fd >= server.capacity) {
+            int oldCapacity = server.capacity;
+
+            server.capacity = fd + 1 > oldCapacity * 2 ? fd + 1 : oldCapacity * 2;
+            server.clients = realloc(server.clients, server.capacity * sizeof(struct client));
+            memset(&server.clients[oldCapacity], 0, (server.capacity - oldCapacity) * sizeof(struct client));
         }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
+        struct client *client = &server.clients[fd];
+        client->fd = fd;
+        client->length = 0;
+        client->sequence = 0;
+        client->running = 0;
+        client->open = 1;
+        event.data.fd = fd;
+        epoll_ctl(server.epollFD, EPOLL_CTL_ADD, fd, &event);
     }
+}
 
-/* adds the background pids to the list at the first available opening 
- * the list is populated by deafault by 0's*/
-void addPidToBackgroundList(pid_t pid) {
-    /* Adds the background PID's the a list for verifying
-       when a background process has exited */
-    
-    for (int i = 0; i < sizeof(currStatus.backgrounds)/sizeof(currStatus.backgrounds[0]); i++){
-        if(currStatus.backgrounds[i] == 0) {
-            currStatus.backgrounds[i] = pid;
-            break;
-        } 
+// Reads what a client sent and runs every complete line in it.
+void readClient(int index) {
+    struct client *client = &server.clients[index];
+
+    if(client->capacity - client->length < 1024) {
+        client->capacity = client->capacity == 0 ? 4096 : client->capacity * 2;
+        client->buffer = realloc(client->buffer, client->capacity);
+    }
+
+    ssize_t bytes = read(client->fd, client->buffer + client->length, client->capacity - client->length - 1);
+    if(bytes == -1 && errno == EINTR) return;
+    if(bytes <= 0) {
+        // The client has finished sending, the replies it is owed still go out.
+        epoll_ctl(server.epollFD, EPOLL_CTL_DEL, client->fd, NULL);
+        client->open = 0;
+        if(client->running == 0) releaseClient(index);
+        return;
+    }
+    client->length += bytes;
+
+    char *start = client->buffer;
+    char *newline;
+    while((newline = memchr(start, '\n', client->buffer + client->length - start)) != NULL) {
+        *newline = '\0';
+        serveLine(index, start);
+        start = newline + 1;
+    }
+    client->length -= start - client->buffer;
+    memmove(client->buffer, start, client->length);
+}
+
+/* Runs one line for a client with stdout and stderr pointed at its output,
+ * the same way runBuiltin() redirects a builtin. A line that starts a job
+ * is answered when the job is reaped, anything else straight away.
+ */
+void serveLine(int index, char *line) {
+    struct client *client = &server.clients[index];
+    int sequence = ++client->sequence;
+    int capture = strncmp(line, "capture ", 8) == 0;
+    int outputFD = -1;
+    struct builtin *builtin;
+
+    if(capture) {
+        line += 8;
+        outputFD = memfd_create("serve", MFD_CLOEXEC);
+    }
+    while(*line == ' ' || *line == '\t') line++;
+    if(verifyUserInput(line) == -1) {
+        replyStatus(client, sequence, outputFD, 0);
+        return;
+    }
+
+    fflush(stdout);
+    int savedOutput = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    int savedError = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(outputFD != -1 ? outputFD : server.nullFD, STDOUT_FILENO);
+    dup2(outputFD != -1 ? outputFD : server.nullFD, STDERR_FILENO);
+
+    long long started = traceStart();
+    struct command *cmd = createCommandList(line);
+    jobTable.lastAdded = -1;
+    backgroundQueue.lastQueued = NULL;
+    if(cmd == NULL) {
+        currStatus.lastStatus = 1;
+    } else if(cmd->next != NULL || hasSubstitution(cmd)) {
+        // A list is one job, run by a fork of the shell. So is a $( ),
+        // which could take any time and is expanded in the fork instead.
+        cmd->listEnd = cmd;
+        while(cmd->listEnd->next != NULL) cmd->listEnd = cmd->listEnd->next;
+        cmd->listEnd->background = 1;
+        if(queueIsFull()) queueJob(cmd);
+        else startBackgroundList(cmd);
+    } else if(expandCommand(cmd) == -1) {
+        currStatus.lastStatus = 1;
+    } else if(cmd->stages[0].argc == 0) {
+        currStatus.lastStatus = 0;
+    } else if(cmd->stageCount == 1 && (builtin = findBuiltin(cmd->stages[0].argv[0])) != NULL) {
+        runBuiltin(&cmd->stages[0], builtin);
+    } else if(queueIsFull()) {
+        cmd->background = 1;
+        queueJob(cmd);
+    } else {
+        cmd->background = 1;
+        dispatchJob(cmd, 1);
+    }
+    traceEnd("dispatch", started, 0);
+
+    fflush(stdout);
+    dup2(savedOutput, STDOUT_FILENO);
+    dup2(savedError, STDERR_FILENO);
+    close(savedOutput);
+    close(savedError);
+
+    if(jobTable.lastAdded != -1) {
+        struct job *job = &jobTable.jobs[jobTable.lastAdded];
+        job->client = index;
+        job->sequence = sequence;
+        job->outputFD = outputFD;
+        client->running++;
+    } else if(backgroundQueue.lastQueued != NULL) {
+        backgroundQueue.lastQueued->client = index;
+        backgroundQueue.lastQueued->sequence = sequence;
+        backgroundQueue.lastQueued->outputFD = outputFD;
+        client->running++;
+    } else {
+        replyStatus(client, sequence, outputFD, currStatus.lastStatus);
+    }
+}
+
+// Whether a deferred word of cmd holds a $( ).
+int hasSubstitution(struct command *cmd) {
+    for(int i = 0; i < cmd->stageCount; i++) {
+        struct stage *stage = &cmd->stages[i];
+        char *redirects[2] = {stage->input, stage->output};
+
+        for(int j = 0; j < stage->argc + 2; j++) {
+            char *word = j < stage->argc ? stage->argv[j] : redirects[j - stage->argc];
+            if(word != NULL && word[0] == DEFERRED_WORD && strstr(word, "$(") != NULL) return 1;
+        }
+    }
+    return 0;
+}
+
+// Sends the captured output, if any, and then the exit status of line sequence.
+void replyStatus(struct client *client, int sequence, int outputFD, int exitStatus) {
+    char header[64];
+    int length;
+
+    if(outputFD != -1) {
+        struct stat info;
+        long long size = fstat(outputFD, &info) == 0 ? (long long)info.st_size : 0;
+
+        length = snprintf(header, sizeof(header), "%d output %lld\n", sequence, size);
+        if(write(client->fd, header, length) == length) flushOutput(outputFD, client->fd);
+        else close(outputFD);
+    }
+    length = snprintf(header, sizeof(header), "%d exit %d\n", sequence, exitStatus);
+    write(client->fd, header, length);
+}
+
+void releaseClient(int index) {
+    struct client *client = &server.clients[index];
+
+    close(client->fd);
+    free(client->buffer);
+    memset(client, 0, sizeof(struct client));
+}
+
+// Called by finishJob() for a job that a client started.
+void serverJobDone(int slot) {
+    struct job *job = &jobTable.jobs[slot];
+    struct client *client = &server.clients[job->client];
+    int exitStatus = WIFSIGNALED(job->status) ? 128 + WTERMSIG(job->status) : WEXITSTATUS(job->status);
+
+    replyStatus(client, job->sequence, job->outputFD, exitStatus);
+    if(--client->running == 0 && !client->open) releaseClient(job->client);
+}
+
+// BACKGROUND QUEUE
+// A new background job waits if the limit is reached or others are waiting.
+int queueIsFull() {
+    return currStatus.maxJobs > 0 && (jobTable.count >= currStatus.maxJobs || backgroundQueue.count > 0);
+}
+
+/* Copies a parsed line, through cmd->listEnd for a list, into a single
+ * heap block that outlives the arena. The commands, stages and argv
+ * arrays come first and the strings after them, so nothing is misaligned.
+ */
+struct command *copyCommand(struct command *cmd) {
+    struct command *last = cmd->listEnd != NULL ? cmd->listEnd : cmd;
+    size_t size = 0;
+
+    for(struct command *part = cmd; ; part = part->next) {
+        size += sizeof(struct command) + part->stageCount * sizeof(struct stage);
+        for(int i = 0; i < part->stageCount; i++) {
+            struct stage *stage = &part->stages[i];
+            size += (stage->argc + 1) * sizeof(char *);
+            for(int j = 0; j < stage->argc; j++) size += strlen(stage->argv[j]) + 1;
+            if(stage->input != NULL) size += strlen(stage->input) + 1;
+            if(stage->output != NULL) size += strlen(stage->output) + 1;
+        }
+        if(part == last) break;
+    }
+
+    struct command *copy = malloc(size), *previous = NULL;
+    char *next = (char *)copy;
+
+    for(struct command *part = cmd; ; part = part->next) {
+        struct command *piece = (struct command *)next;
+
+        next += sizeof(struct command);
+        *piece = *part;
+        piece->next = NULL;
+        piece->listEnd = NULL;
+        piece->stages = (struct stage *)next;
+        piece->stageCapacity = part->stageCount;
+        next += part->stageCount * sizeof(struct stage);
+        for(int i = 0; i < part->stageCount; i++) {
+            struct stage *stage = &piece->stages[i];
+            *stage = part->stages[i];
+            stage->argv = (char **)next;
+            stage->capacity = stage->argc + 1;
+            next += (stage->argc + 1) * sizeof(char *);
+        }
+        if(previous != NULL) previous->next = piece;
+        previous = piece;
+        if(part == last) break;
     }
+    if(cmd->listEnd != NULL) copy->listEnd = previous;
+
+    for(struct command *piece = copy, *part = cmd; piece != NULL; piece = piece->next, part = part->next) {
+        for(int i = 0; i < piece->stageCount; i++) {
+            struct stage *stage = &piece->stages[i];
+            for(int j = 0; j < stage->argc; j++) next = stpcpy(stage->argv[j] = next, part->stages[i].argv[j]) + 1;
+            stage->argv[stage->argc] = NULL;
+            if(stage->input != NULL) next = stpcpy(stage->input = next, part->stages[i].input) + 1;
+            if(stage->output != NULL) next = stpcpy(stage->output = next, part->stages[i].output) + 1;
+        }
+    }
+    return copy;
+}
+
+void queueJob(struct command *cmd) {
+    struct queuedJob *entry = malloc(sizeof(struct queuedJob));
+
+    entry->cmd = copyCommand(cmd);
+    entry->hasLimits = currStatus.limits != NULL;
+    if(entry->hasLimits) entry->limits = *currStatus.limits;
+    entry->hasPlacement = currStatus.placement != NULL;
+    if(entry->hasPlacement) entry->placement = *currStatus.placement;
+    entry->client = -1;
+    entry->sequence = 0;
+    entry->outputFD = -1;
+    entry->next = NULL;
+
+    if(backgroundQueue.tail == NULL) backgroundQueue.head = entry;
+    else backgroundQueue.tail->next = entry;
+    backgroundQueue.tail = entry;
+    backgroundQueue.count++;
+    backgroundQueue.lastQueued = entry;
+
+    if(!jobTable.quiet) printf("Queued background job, %d waiting\n", backgroundQueue.count);
+    currStatus.lastStatus = 0;
 }
 
-/* This will iterate through the list of background pid's and verify its completion
- * status. If it exited normally or was terminated by a signal input.
+/* Starts waiting jobs while there is room. Only called where no job is
+ * being looked at, since starting one can move the job table.
  */
-void checkPid() {
-    /* Iterates through the pid list to see if a background process
-      has completed. This will be ran when startShell is run so it 
-      will not activate until a new command is entered. */
+void startQueuedJobs() {
+    while(backgroundQueue.head != NULL && (currStatus.maxJobs == 0 || jobTable.count < currStatus.maxJobs)) {
+        struct queuedJob *entry = backgroundQueue.head;
+        int savedOutput = -1, savedError = -1;
+
+        backgroundQueue.head = entry->next;
+        if(backgroundQueue.head == NULL) backgroundQueue.tail = NULL;
+        backgroundQueue.count--;
+
+        // A server job writes where its client asked, as in serveLine().
+        if(entry->client != -1) {
+            fflush(stdout);
+            savedOutput = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+            savedError = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+            dup2(entry->outputFD != -1 ? entry->outputFD : server.nullFD, STDOUT_FILENO);
+            dup2(entry->outputFD != -1 ? entry->outputFD : server.nullFD, STDERR_FILENO);
+        }
 
-    for (int i = 0; i < sizeof(currStatus.backgrounds)/sizeof(currStatus.backgrounds[0]); i++) {
-        if(currStatus.backgrounds[i] > 1) {
-            int childStatus;
-            pid_t pid = currStatus.backgrounds[i];
-            while((waitpid(pid, &childStatus, WNOHANG) > 0)){
-                if(WIFEXITED(pid)) {
-                    printf("background pid %d is done: exit value %d\n", pid, childStatus);
-                } else if (WIFSIGNALED(pid)) {
-                    printf("background pid %d terminated: signal %d\n", pid, childStatus);
-                } 
+        currStatus.limits = entry->hasLimits ? &entry->limits : NULL;
+        currStatus.placement = entry->hasPlacement ? &entry->placement : NULL;
+        jobTable.lastAdded = -1;
+        if(entry->cmd->listEnd != NULL) startBackgroundList(entry->cmd);
+        else dispatchJob(entry->cmd, 1);
+        currStatus.limits = NULL;
+        currStatus.placement = NULL;
+
+        if(entry->client != -1) {
+            fflush(stdout);
+            dup2(savedOutput, STDOUT_FILENO);
+            dup2(savedError, STDERR_FILENO);
+            close(savedOutput);
+            close(savedError);
+
+            struct client *client = &server.clients[entry->client];
+            if(jobTable.lastAdded != -1) {
+                struct job *job = &jobTable.jobs[jobTable.lastAdded];
+                job->client = entry->client;
+                job->sequence = entry->sequence;
+                job->outputFD = entry->outputFD;
+            } else {
+                replyStatus(client, entry->sequence, entry->outputFD, currStatus.lastStatus);
+                if(--client->running == 0 && !client->open) releaseClient(entry->client);
             }
         }
+        free(entry->cmd);
+        free(entry);
+    }
+}
+
+/* The queue command.
+ * queue        -> show how many jobs are running, waiting and finished
+ * queue N      -> let N background jobs run at once, 0 for any number
+ */
+void queueCommand(struct stage *stage) {
+    if(stage->argc > 1) {
+        char *end;
+        long limit = strtol(stage->argv[1], &end, 10);
+        if(end == stage->argv[1] || *end != '\0' || limit < 0) {
+            fprintf(stderr, "queue: %s: not a number\n", stage->argv[1]);
+            currStatus.lastStatus = 1;
+            return;
+        }
+        currStatus.maxJobs = limit;
+        startQueuedJobs();
     }
+
+    printf("running %d, queued %d, finished %ld, ", jobTable.count, backgroundQueue.count, jobTable.finished);
+    if(currStatus.maxJobs == 0) printf("no limit\n");
+    else printf("limit %d\n", currStatus.maxJobs);
+    currStatus.lastStatus = 0;
 }
 
 /* Signal function to toggle foreground only mode */
@@ -877,99 +5838,21 @@ void toggleForegroundMode(int signo) {
     }
 }
 
-/* handles the SIGINT interrupt for the foreground process */
-void handleSignals(int signo) {
-    _exit(0);
-}
-
 /* This executes normal processes with no redirect flags 
  * similarly it uses a flag to run both foreground and background
  * processes.
  */
-void runProcess(struct command *list, int type){
-
-    /* Reset the signal interrupts */
-    struct sigaction SIGINT_action = {{0}};
-
-    sigfillset(&SIGINT_action.sa_mask);
+void runProcess(struct command *cmd, int type){
 
-    SIGINT_action.sa_flags = SA_RESTART;
-
-    // Toggle forergound only mode
-    SIGINT_action.sa_handler = toggleForegroundMode;
-    sigaction(SIGTSTP, &SIGINT_action, NULL);
+    pid_t childID = launchProcess(cmd->stages[0].argv, NULL, NULL, type);
+    if(childID == -1) return;
 
+    // If the child process was terminated by a signal interrupt
+    // it will print the signal to the screen.
+    // Otherwise it will hold the parent process until completed.
     if(type == 0) {
-        // Foreground process can be interrupted.
-        SIGINT_action.sa_handler = handleSignals;
-        sigaction(SIGINT, &SIGINT_action, NULL);
+        waitForeground(childID);
     } else {
-        // All other processes ignore SIGINT
-        SIGINT_action.sa_handler = SIG_IGN;
-        sigaction(SIGINT, &SIGINT_action, NULL);
-    }
-    
-    // Parses the linked list for commands and 
-    // puts them into an array for input into execvp
-    // since the background process is run by a flag
-    // it ignores that command.
-    struct command *currList = list;
-
-    char *newargv[513];
-    int i = 0;
-
-    while(currList != NULL) {
-        if(strcmp(currList->command, "&") != 0) {
-            newargv[i] = currList->command;
-            i++;
-        } 
-        currList = currList->next;
+        startBackgroundJob(cmd, &childID, 1);
     }
-    // Stops edge cases of the first command not being formatted right.
-    newargv[i] = NULL;
-
-    int childStatus;
-    pid_t childID = fork();
-    switch(childID){
-        case -1:
-            currStatus.lastStatus = -1;
-            perror("fork() error: \n");
-            break;
-        case 0:
-            execvp(newargv[0], newargv);
-            perror("execv error: \n");
-            exit(1);
-            break;
-        default:
-            // Restores ignore upon return to parent process
-            SIGINT_action.sa_handler = SIG_IGN;
-            sigaction(SIGINT, &SIGINT_action, NULL);
-            fflush(stdin);
-            fflush(stdout);
-            // If the child process was terminated by a signal interrupt
-            // it will print the signal to the screen.
-            // Otherwise it will hold the parent process until completed.
-            if(type == 0) {
-                childID = waitpid(childID, &childStatus, 0);
-                if (WIFSIGNALED(childStatus)) {
-                    printf("pid %d terminated: signal %d\n", childID, childStatus);
-                }
-                currStatus.lastStatus = WEXITSTATUS(childStatus) == 0 ? 0 : 1;
-                cleanMemoryAndReturnToShell(list);
-            fflush(stdout);
-            fflush(stdin);
-            } else if(type == 1) {
-                char *backgroundMessage = calloc(47, sizeof(char));
-                sprintf(backgroundMessage, "Starting Background Process for id: %d\n", childID);
-                write(STDOUT_FILENO, backgroundMessage, 47);
-                fflush(stdout);
-                free(backgroundMessage);
-                // Adds the pid to the backgroujnd pid list for procesing.
-                addPidToBackgroundList(childID);
-                break;
-            }       
-        }
-    cleanMemoryAndReturnToShell(list);
-    
 }
-
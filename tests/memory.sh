@@ -0,0 +1,53 @@
+#!/bin/sh
+# Feeds a million trivial builtin commands and some thousands of external
+# ones, bare and with redirects, to one smallsh through a pipe and
+# compares the peak resident size (VmHWM) and the stack size (VmStk) the
+# shell reports in /proc before and after them. Neither should grow by
+# more than a few pages.
+#
+#   tests/memory.sh ./smallsh
+
+shell=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+commands=1000000
+forked=4000
+work=$(mktemp -d)
+
+# Each batch runs builtins in the shell, then children through
+# runProcess() and redirectProcess().
+batch() {
+    yes true | head -n $1
+    yes /bin/true | head -n $2
+    yes "cat < $work/in > $work/out" | head -n $2
+}
+
+{
+    echo "echo line > $work/in"
+    batch 1000 100
+    echo "cat /proc/\$\$/status > $work/start"
+    batch $commands $forked
+    echo "cat /proc/\$\$/status > $work/end"
+} | SMALLSH_CACHE= SMALLSH_HISTORY= "$shell" > /dev/null 2>&1
+
+# Prints the value in kB of field $1 of status file $2.
+field() {
+    awk -v name="$1:" '$1 == name { print $2 }' "$2"
+}
+
+failed=0
+for check in VmHWM:64 VmStk:8; do
+    name=${check%:*}
+    slack=${check#*:}
+    before=$(field $name "$work/start")
+    after=$(field $name "$work/end")
+    if [ -z "$before" ] || [ -z "$after" ]; then
+        echo "FAIL memory ($name missing)"
+        failed=1
+    elif [ $((after - before)) -gt $slack ]; then
+        echo "FAIL memory ($name grew from $before kB to $after kB)"
+        failed=1
+    else
+        echo "ok   memory ($name $before kB -> $after kB)"
+    fi
+done
+rm -rf "$work"
+exit $failed
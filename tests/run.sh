@@ -0,0 +1,44 @@
+#!/bin/sh
+# Runs each tests/*.smallsh script through smallsh in an empty directory
+# and compares what it prints with the .expected file next to it. Runs of
+# three or more digits, like pids, are printed as N. Every script is run
+# from its text, compiled into a fresh cache, from that cache, and then
+# from a cache with its second half overwritten and from one that group
+# members can write, which must both be ignored.
+#
+#   tests/run.sh ./smallsh
+
+shell=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+here=$(cd "$(dirname "$0")" && pwd)
+failed=0
+
+for script in "$here"/*.smallsh; do
+    name=$(basename "$script" .smallsh)
+    work=$(mktemp -d)
+    mkdir "$work/run" "$work/cache"
+
+    for pass in text compile cached damaged shared; do
+        cache="$work/cache"
+        [ $pass = text ] && cache=
+        for file in "$cache"/*.smc; do
+            [ -f "$file" ] || continue
+            if [ $pass = damaged ]; then
+                half=$(($(wc -c < "$file") / 2))
+                head -c $half /dev/zero | tr '\0' '\377' | dd of="$file" bs=1 seek=$half conv=notrunc 2> /dev/null
+            elif [ $pass = shared ]; then
+                chmod g+w "$file"
+            fi
+        done
+        (cd "$work/run" && SMALLSH_CACHE=$cache SMALLSH_HISTORY= "$shell" "$script" < /dev/null 2>&1) |
+            sed -E 's/[0-9]{3,}/N/g' > "$work/output"
+        if diff -u "$here/$name.expected" "$work/output"; then
+            echo "ok   $name ($pass)"
+        else
+            echo "FAIL $name ($pass)"
+            failed=1
+        fi
+        rm -rf "$work/run"/*
+    done
+    rm -rf "$work"
+done
+exit $failed